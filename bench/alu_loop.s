@@ -0,0 +1,18 @@
+ldr w9, iterations
+movz x1, #1
+movz x2, #0
+loop:
+add x2, x2, x1
+eor x3, x2, x1, lsl #7
+orr x4, x3, x2, lsr #3
+and x5, x4, x3, asr #2
+bic x6, x5, x1
+add x1, x1, x6, lsr #5
+sub x7, x5, x4
+eon x8, x7, x2
+subs x9, x9, #1
+b.ne loop
+and x0, x0, x0
+
+iterations:
+.int 2000000
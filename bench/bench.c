@@ -0,0 +1,110 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// runs each guest program through emulate --stats, in every mode, and prints one CSV line per
+// program and mode with the best of several runs:
+// program,mode,instructions,seconds,mips,ns_per_instr,max_rss_kib
+
+#define STATS_SIZE 256
+
+typedef struct {
+	uint64_t instructions;
+	double seconds;
+	long max_rss_kib;
+} RunResult;
+
+static const char *const modes[] = {"interp", "jit"};
+
+// runs {emulate} on {program} once, reading its --stats line from stderr
+static bool run_once(const char *emulate, const char *program, bool jit, RunResult *result) {
+	int fds[2];
+	if (pipe(fds) != 0)
+		return false;
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		close(fds[0]);
+		if (jit)
+			execl(emulate, emulate, "--stats", "--jit", program, (char *)NULL);
+		else
+			execl(emulate, emulate, "--stats", program, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	char stats[STATS_SIZE] = {0};
+	size_t used = 0;
+	ssize_t bytes_read;
+	while ((bytes_read = read(fds[0], stats + used, STATS_SIZE - 1 - used)) > 0) {
+		used += bytes_read;
+	}
+	close(fds[0]);
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return false;
+	result->max_rss_kib = usage.ru_maxrss;
+
+	// the last line is the --stats one, anything before it is the guest's own output
+	char *line = strstr(stats, " instructions in ");
+	while (line > stats && line[-1] != '\n') {
+		line--;
+	}
+	return line && sscanf(line, "%" SCNu64 " instructions in %lf s", &result->instructions,
+						  &result->seconds) == 2;
+}
+
+int main(int argc, char **argv) {
+	int runs = 3;
+	int first = 1;
+	if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+		runs = atoi(argv[2]);
+		first = 3;
+	}
+	if (argc - first < 2 || runs < 1) {
+		fprintf(stderr, "Usage: %s [-r runs] <emulate> <program.bin>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *emulate = argv[first];
+
+	int failures = 0;
+	printf("program,mode,instructions,seconds,mips,ns_per_instr,max_rss_kib\n");
+	for (int i = first + 1; i < argc; ++i) {
+		for (size_t mode = 0; mode < sizeof(modes) / sizeof(modes[0]); ++mode) {
+			RunResult best = {0};
+			bool ok = true;
+			for (int run = 0; run < runs && ok; ++run) {
+				RunResult result;
+				ok = run_once(emulate, argv[i], mode == 1, &result);
+				if (ok && (run == 0 || result.seconds < best.seconds))
+					best = result;
+			}
+			if (!ok) {
+				fprintf(stderr, "Failed to run %s (%s)\n", argv[i], modes[mode]);
+				failures++;
+				continue;
+			}
+			double mips = best.seconds > 0 ? best.instructions / best.seconds / 1e6 : 0;
+			double ns = best.instructions ? best.seconds * 1e9 / best.instructions : 0;
+			printf("%s,%s,%" PRIu64 ",%.6f,%.2f,%.3f,%ld\n", argv[i], modes[mode],
+				   best.instructions, best.seconds, mips, ns, best.max_rss_kib);
+			fflush(stdout);
+		}
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+ldr w9, iterations
+movz x1, #12345
+movz x20, #1
+movz x21, #0
+movz x5, #0
+movz x6, #0
+movz x7, #0
+loop:
+eor x1, x1, x1, lsl #13
+eor x1, x1, x1, lsr #7
+eor x1, x1, x1, lsl #17
+ands x2, x1, x20
+b.eq even
+add x5, x5, #1
+b next
+even:
+cmp x1, x21
+b.lt low
+add x6, x6, #1
+b next
+low:
+add x7, x7, #1
+next:
+subs x9, x9, #1
+b.ne loop
+and x0, x0, x0
+
+iterations:
+.int 2000000
@@ -0,0 +1,17 @@
+ldr w9, iterations
+movz x1, #3
+movz x2, #5
+movz x3, #7
+loop:
+madd x1, x1, x2, x3
+msub x2, x2, x3, x1
+mul x3, x3, x1
+madd x4, x1, x3, x2
+mneg x5, x4, x2
+add x3, x3, #1
+subs x9, x9, #1
+b.ne loop
+and x0, x0, x0
+
+iterations:
+.int 2000000
@@ -5,8 +5,8 @@
 #endif
 
 #include <time.h>
-#include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <signal.h>
 #include <pthread.h>
 #include <stdatomic.h>
@@ -16,17 +16,47 @@
 #include <string.h>
 #include "lcd_i2c.h"
 #include "maker.h"
+#include "vclock.h"
+
+#define EVENT_QUEUE_SIZE 32
+
+// what the main loop reacts to. it sleeps until one is posted or the current state times out
+typedef enum { UP_PRESSED, DOWN_PRESSED, SELECT_PRESSED, POUR_FINISHED, QUIT } Event;
+
+static struct {
+    pthread_mutex_t lock;
+    Event events[EVENT_QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+    VClockSem ready; // posted once per queued event
+} event_queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = VCLOCK_SEM_INIT};
 
-// current cocktail selection
-static volatile FSMState cur_selection = Start; 
-// to handle transition to FinishDispensing state
-static volatile bool drink_pouring_done = false;
 static atomic_bool pouring_error = false;
-static volatile bool running = true;
 
-static uint32_t last_up_time = 0;
-static uint32_t last_down_time = 0;
-static uint32_t last_select_time = 0;
+// when a button was last pressed. ticks start at 0 too, so a first press has to be told apart
+typedef struct {
+    bool pressed;
+    uint32_t tick;
+} LastPress;
+
+static LastPress last_up, last_down, last_select;
+
+// a pump's worker thread, started once and handed one pour at a time. the duration is written
+// before pending is posted, and the clock's lock orders it before the worker's wait returns
+typedef struct {
+    int duration_ms;
+    atomic_bool busy; // from handing a pour over until the worker has finished it
+    VClockSem pending; // posted once per pour, for the worker to sleep on
+} Pump;
+
+static Pump pumps[NUM_INGREDIENTS];
+// pumps still pouring the current drink, the last one to finish reports it
+static atomic_int pumps_pouring = 0;
+
+#ifndef ON_PI
+// button presses of a simulated session
+static FILE *script = NULL;
+#endif
 
 FILE *err_out;
 
@@ -44,12 +74,8 @@ static const int drinks[][NUM_INGREDIENTS] = {
 #undef X
 };
 
-static void handle_sigint(int sig) {
-    running = false;
-}
-
 void print_with_timestamp(FILE *fp, const char *message) {
-    time_t now = time(NULL);
+    time_t now = vclock_time();
     struct tm *t = localtime(&now);
 
     char buf[64];
@@ -58,40 +84,97 @@ void print_with_timestamp(FILE *fp, const char *message) {
     fprintf(fp, "[%s] %s\n", buf, message);
 }
 
-// all buttons deactivated if in a machine-controlled state
+// safe from any thread. the queue only fills up if the main loop is stuck, so events past that
+// are dropped
+static void post_event(Event event) {
+    pthread_mutex_lock(&event_queue.lock);
+    bool full = event_queue.count == EVENT_QUEUE_SIZE;
+    if (!full) {
+        event_queue.events[(event_queue.head + event_queue.count) % EVENT_QUEUE_SIZE] = event;
+        ++event_queue.count;
+    }
+    pthread_mutex_unlock(&event_queue.lock);
+    if (full) {
+        print_with_timestamp(err_out, "Event queue full, dropping event");
+        return;
+    }
+    vclock_post(&event_queue.ready);
+}
+
+// blocks until an event is posted, false if {deadline_us} came first
+static bool next_event(Event *event, uint64_t deadline_us) {
+    if (!vclock_wait(&event_queue.ready, deadline_us)) return false;
+    pthread_mutex_lock(&event_queue.lock);
+    *event = event_queue.events[event_queue.head];
+    event_queue.head = (event_queue.head + 1) % EVENT_QUEUE_SIZE;
+    --event_queue.count;
+    pthread_mutex_unlock(&event_queue.lock);
+    return true;
+}
+
+// true unless {tick} is too soon after the {last} press, which it then becomes
+static bool debounce(LastPress *last, uint32_t tick) {
+    if (last->pressed && tick - last->tick < DEBOUNCE_TIME) return false;
+    *last = (LastPress){.pressed = true, .tick = tick};
+    return true;
+}
+
+// the callbacks only debounce, what a press does is up to the main loop
 static void up_cb(int gpio, int level, uint32_t tick) {
     if (level != 1) return;
-    if (tick - last_up_time < DEBOUNCE_TIME) return;
-    last_up_time = tick;
-    if (cur_selection > 0 && cur_selection < ThatsIt) cur_selection--;
+    if (!debounce(&last_up, tick)) return;
+    post_event(UP_PRESSED);
 }
 
 static void down_cb(int gpio, int level, uint32_t tick) {
     if (level != 1) return;
-    if (tick - last_down_time < DEBOUNCE_TIME) return;
-    last_down_time = tick;
-    if (cur_selection < ThatsIt) cur_selection++;
-    // ThatsIt used as "last" drink
+    if (!debounce(&last_down, tick)) return;
+    post_event(DOWN_PRESSED);
 }
 
 static void select_cb(int gpio, int level, uint32_t tick) {
     if (level != 1) return;
-    if (tick - last_select_time < DEBOUNCE_TIME) return;
-    last_select_time = tick;
-    if (cur_selection >= 0 && cur_selection < ThatsIt) {
-        assert(cur_selection >= 0 && cur_selection < TOTAL_STATE_COUNT);
-        // quick assertion that cur_state is valid
-        switch (cur_selection) {
-            case Dispensing:
-            case FinishDispensing:
-            case Start:
-            case ThatsIt:
-            case Error:
-                break; // do nothing
-            default:
-                assert(cur_selection < ThatsIt); // cur_state should be a drink
-                cur_selection = Dispensing; // set to dispensing
-        }
+    if (!debounce(&last_select, tick)) return;
+    post_event(SELECT_PRESSED);
+}
+
+// SIGINT is blocked in every thread and taken here instead, where it can be posted safely
+static void *signal_thread(void *arg) {
+    sigset_t *signals = arg;
+    int sig;
+    sigwait(signals, &sig);
+    post_event(QUIT);
+    return NULL;
+}
+
+// the state after {event} in {state}. all buttons deactivated if in a machine-controlled state
+static FSMState handle_event(FSMState state, Event event) {
+    switch (event) {
+        case UP_PRESSED:
+            return state > 0 && state < ThatsIt ? state - 1 : state;
+        case DOWN_PRESSED:
+            return state < ThatsIt ? state + 1 : state; // ThatsIt used as "last" drink
+        case SELECT_PRESSED:
+            return state < ThatsIt ? Dispensing : state;
+        case POUR_FINISHED:
+            return pouring_error ? Error : FinishDispensing;
+        default:
+            return state;
+    }
+}
+
+// the state after {state} has been shown for STATE_TRANSITION_TIME
+static FSMState handle_timeout(FSMState state) {
+    switch (state) {
+        case FinishDispensing:
+        case Start:
+        case Error:
+            return 0; // to first drink
+        case ThatsIt:
+            return ThatsIt - 1; // to last drink
+        default:
+            assert(false); // no other states should reach this
+            return state;
     }
 }
 
@@ -108,112 +191,138 @@ static void stop_all_pumps() {
     }
 }
              
-static void *pump_timer_thread(void *arg) {
-    int ingredient =  ((int *)arg)[0];
-    int duration_ms = ((int *)arg)[1];
-    free(arg);
-
-    // early termination if another thread has an error
-    if (pouring_error) return NULL;
-
-    #if defined(EMU_OUTPUT) || defined(DEBUG)
-    char msg_on[64];
-    snprintf(msg_on, sizeof(msg_on), "Turning on pump %d", ingredient);
-    print_with_timestamp(stdout, msg_on);
-    #endif
-    #ifndef EMU_OUTPUT
-    gpioWrite(pump_gpio_pins[ingredient], 1); // turn on pump
-    #endif
-    usleep(duration_ms  * 1000);
-    #if defined(EMU_OUTPUT) || defined(DEBUG)
-    char msg_off[64];
-    snprintf(msg_off, sizeof(msg_off), "Turning off pump %d", ingredient);
-    print_with_timestamp(stdout, msg_off);
-    #endif
-    #ifndef EMU_OUTPUT
-    gpioWrite(pump_gpio_pins[ingredient], 0); // turn off pump
-    #endif
+// false if {pump} has not finished its last pour yet
+static bool pump_start(Pump *pump, int duration_ms) {
+    if (atomic_exchange(&pump->busy, true)) {
+        return false;
+    }
+    pump->duration_ms = duration_ms;
+    vclock_post(&pump->pending);
+    return true;
+}
 
-    return NULL;
+// one pump of the current drink is done
+static void pump_finished(void) {
+    if (atomic_fetch_sub(&pumps_pouring, 1) == 1) {
+        stop_all_pumps(); // for safety
+        post_event(POUR_FINISHED);
+    }
 }
 
-static void *pour_drink_thread(void *arg) {
-    FSMState drink = *(FSMState *)arg;
-    free(arg);
+static void *pump_thread(void *arg) {
+    int ingredient = (int)(intptr_t)arg;
+    Pump *pump = &pumps[ingredient];
+    while (true) {
+        vclock_wait(&pump->pending, VCLOCK_FOREVER);
+        int duration_ms = pump->duration_ms;
+
+        // early termination if another pump has an error
+        if (pouring_error) {
+            atomic_store(&pump->busy, false);
+            pump_finished();
+            continue;
+        }
 
-    pthread_t pump_threads[NUM_INGREDIENTS];
-    bool pump_thread_created[NUM_INGREDIENTS] = {false};
-    int max_duration_ms = 0;
+        #if defined(EMU_OUTPUT) || defined(DEBUG)
+        char msg_on[64];
+        snprintf(msg_on, sizeof(msg_on), "Turning on pump %d", ingredient);
+        print_with_timestamp(stdout, msg_on);
+        #endif
+        #ifndef EMU_OUTPUT
+        gpioWrite(pump_gpio_pins[ingredient], 1); // turn on pump
+        #endif
+        vclock_sleep_us(duration_ms * 1000ULL);
+        #if defined(EMU_OUTPUT) || defined(DEBUG)
+        char msg_off[64];
+        snprintf(msg_off, sizeof(msg_off), "Turning off pump %d", ingredient);
+        print_with_timestamp(stdout, msg_off);
+        #endif
+        #ifndef EMU_OUTPUT
+        gpioWrite(pump_gpio_pins[ingredient], 0); // turn off pump
+        #endif
+
+        atomic_store(&pump->busy, false);
+        pump_finished();
+    }
+    return NULL;
+}
 
+// starts the worker of every pump, which then waits for something to pour for good
+static bool start_pumps(void) {
     for (int i = 0; i < NUM_INGREDIENTS; ++i) {
-        int part_count = drinks[drink][i];
-        if (part_count > 0) { // only create threads for actually poured ingredients
-            int duration_ms = (int)(part_count * VOLUME_PER_PART * TIME_PER_ML * 1000.0);
-            if (duration_ms > max_duration_ms) max_duration_ms = duration_ms;
+        if (!vclock_thread_create(pump_thread, (void *)(intptr_t)i)) {
+            char err_msg[64];
+            snprintf(err_msg, sizeof(err_msg), "Failed to create thread for pump %d", i);
+            print_with_timestamp(err_out, err_msg);
+            return false;
+        }
+    }
+    return true;
+}
 
-            int *args = malloc(2 * sizeof(int));
-            if (args == NULL) {
-                char err_msg[64];
-                snprintf(err_msg, sizeof(err_msg), "Failed to malloc for pump %d", i);
-                print_with_timestamp(err_out, err_msg);
-                pouring_error = true;
-                stop_all_pumps();
-                break; // dont create more threads
-            }
+// hands every ingredient of {drink_selection} to its pump, without waiting for any of them.
+// POUR_FINISHED is posted once they are all done
+static void pour_drink(FSMState drink_selection) {
+    assert(drink_selection >= 0 && drink_selection < ThatsIt); // make sure its actually a drink
 
-            args[0] = i;           // ingredient number
-            args[1] = duration_ms; // time to pour
+    int pumps_needed = 0;
+    for (int i = 0; i < NUM_INGREDIENTS; ++i) {
+        pumps_needed += drinks[drink_selection][i] > 0;
+    }
+    if (pumps_needed == 0) {
+        post_event(POUR_FINISHED);
+        return;
+    }
+    atomic_store(&pumps_pouring, pumps_needed);
 
-            if (pthread_create(&pump_threads[i], NULL, pump_timer_thread, args) != 0) {
+    for (int i = 0; i < NUM_INGREDIENTS; ++i) {
+        int part_count = drinks[drink_selection][i];
+        if (part_count > 0) { // only start pumps for actually poured ingredients
+            int duration_ms = (int)(part_count * VOLUME_PER_PART * TIME_PER_ML * 1000.0);
+            if (!pump_start(&pumps[i], duration_ms)) {
                 char err_msg[64];
-                snprintf(err_msg, sizeof(err_msg), "Failed to create thread for pump %d", i);
+                snprintf(err_msg, sizeof(err_msg), "Pump %d is still busy", i);
                 print_with_timestamp(err_out, err_msg);
                 pouring_error = true;
-                stop_all_pumps();
-                free(args);
-                break;
+                pump_finished();
             }
-
-            pump_thread_created[i] = true;
         }
     }
+}
 
-    // wait for all threads to terminate
-    for (int i = 0; i < NUM_INGREDIENTS; ++i) {
-        if (pump_thread_created[i]) {
-            pthread_join(pump_threads[i], NULL);
+#ifndef ON_PI
+// presses the buttons of a simulated session from {script}, one "<ms> <up|down|select|quit>"
+// per line, with times since the start. the session ends at quit or after the last press
+static void *script_thread(void *arg) {
+    unsigned long ms;
+    char button[16];
+    while (fscanf(script, "%lu %15s", &ms, button) == 2) {
+        uint64_t at = ms * 1000ULL;
+        if (at > vclock_now_us()) vclock_sleep_us(at - vclock_now_us());
+
+        int gpio;
+        if (strcmp(button, "up") == 0) {
+            gpio = UP_BUTTON;
+        } else if (strcmp(button, "down") == 0) {
+            gpio = DOWN_BUTTON;
+        } else if (strcmp(button, "select") == 0) {
+            gpio = SELECT_BUTTON;
+        } else {
+            if (strcmp(button, "quit") != 0) {
+                char err_msg[64];
+                snprintf(err_msg, sizeof(err_msg), "Unknown button %s in script", button);
+                print_with_timestamp(err_out, err_msg);
+            }
+            break;
         }
+        gpioEmuAlert(gpio, 1);
+        gpioEmuAlert(gpio, 0);
     }
-
-    stop_all_pumps(); // for safety
-
-    drink_pouring_done = true;
+    fclose(script);
+    post_event(QUIT);
     return NULL;
 }
-
-static void pour_drink(FSMState drink_selection) {
-    assert(drink_selection >= 0 && drink_selection < ThatsIt); // make sure its actually a drink
-
-    FSMState *arg = malloc(sizeof(FSMState));
-    if (arg == NULL) {
-        
-        char err_msg[128];
-        snprintf(err_msg, sizeof(err_msg), "Failed to malloc for pouring drink %s", FSMState_strings[drink_selection]);
-        print_with_timestamp(err_out, err_msg);
-        pouring_error = true;
-    }
-    *arg = drink_selection;
-
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, pour_drink_thread, arg) != 0) {
-        char err_msg[128];
-        snprintf(err_msg, sizeof(err_msg), "Failed to initialise thread for pouring %s", FSMState_strings[drink_selection]);
-        print_with_timestamp(err_out, err_msg);
-        pouring_error = true;
-    } else {
-        pthread_detach(tid);
-    }
-}
+#endif
 
 int main(int argc, char *argv[]) {
     err_out = stderr;
@@ -225,6 +334,17 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
         }
+        #ifndef ON_PI
+        // simulated session, on a clock that skips ahead instead of waiting
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            script = fopen(argv[++i], "r");
+            if (script == NULL) {
+                print_with_timestamp(stderr, "Failed to open script");
+                return EXIT_FAILURE;
+            }
+            vclock_init(true);
+        }
+        #endif
     }
 
     #ifdef ON_PI
@@ -248,7 +368,17 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    signal(SIGINT, handle_sigint); // to handle CTRL+C
+    // to handle CTRL+C, blocked before pigpio starts its threads so they all leave it to ours
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t signal_tid;
+    if (pthread_create(&signal_tid, NULL, signal_thread, &signals) != 0) {
+        print_with_timestamp(err_out, "Failed to create thread for signals");
+        return EXIT_FAILURE;
+    }
+    pthread_detach(signal_tid);
 
     gpioCfgSetInternals(PI_CFG_NOSIGHANDLER);
     gpioInitialise();
@@ -284,48 +414,52 @@ int main(int argc, char *argv[]) {
         print_with_timestamp(err_out, "Error initialising lcd. Ensure i2c is enabled and lcd correctly connected");
         return EXIT_FAILURE;
     }
-    time_t state_start_time = time(NULL); // set to current time for Start state
-    FSMState last_state = TOTAL_STATE_COUNT;
+    if (!start_pumps()) {
+        return EXIT_FAILURE;
+    }
 
-    while (running) {
-        if (last_state != cur_selection) {
-            lcd_clear(lcd_handle);
-            lcd_write_string(lcd_handle, FSMState_strings[cur_selection]);
-            if (cur_selection == Dispensing) {
-                pour_drink(last_state);
-            }
-            state_start_time = time(NULL);
-            last_state = cur_selection;
+    #ifndef ON_PI
+    if (script != NULL) {
+        if (!vclock_thread_create(script_thread, NULL)) {
+            print_with_timestamp(err_out, "Failed to create thread for script");
+            return EXIT_FAILURE;
         }
-        if ((cur_selection == Start || cur_selection == ThatsIt || cur_selection == FinishDispensing) && time(NULL) - state_start_time >= STATE_TRANSITION_TIME) {
-            switch(cur_selection) {
-                case FinishDispensing:
-                case Start:
-                case Error:
-                    cur_selection = 0; // to first drink
-                    break;
-                case ThatsIt:
-                    cur_selection = ThatsIt - 1; // to last drink
-                    break;
-                default:
-                    assert(false); // no other states should reach this
-            }
+    }
+    #endif
+
+    FSMState state = Start;
+    lcd_clear(lcd_handle);
+    lcd_write_string(lcd_handle, FSMState_strings[state]);
+    uint64_t state_start_time = vclock_now_us();
+
+    while (true) {
+        // only these states move on by themselves, the rest wait for an event
+        bool timed = state == Start || state == ThatsIt || state == FinishDispensing;
+        uint64_t deadline = timed ? state_start_time + STATE_TRANSITION_TIME * US_PER_SEC
+                                  : VCLOCK_FOREVER;
+        Event event;
+        FSMState next;
+        if (!next_event(&event, deadline)) {
+            next = handle_timeout(state);
+        } else if (event == QUIT) {
+            break;
+        } else {
+            next = handle_event(state, event);
         }
-        if (drink_pouring_done) {
-            drink_pouring_done = false;
 
-            if (pouring_error) { // handling error state
-                cur_selection = Error;
-            } else {
-                cur_selection = FinishDispensing;
+        if (next != state) {
+            lcd_clear(lcd_handle);
+            lcd_write_string(lcd_handle, FSMState_strings[next]);
+            if (next == Dispensing) {
+                pour_drink(state);
             }
-            continue; // skip wait, to automatically update state
+            state_start_time = vclock_now_us();
+            state = next;
         }
-        usleep(0.1 * 1000 * 1000); // 0.1s
     }
     lcd_clear(lcd_handle);
     lcd_write_string(lcd_handle, "Machine terminating...");
-    sleep(3); // 1s
+    vclock_sleep_us(3 * US_PER_SEC);
     lcd_clear(lcd_handle);
     lcd_close(lcd_handle);
     stop_all_pumps(); // rather be safe than sorry...
@@ -1,51 +1,69 @@
 #include "pigpio_emu.h"
+#include "vclock.h"
 #include <stdio.h>
-#include <unistd.h>
-#include <time.h>
 #include <inttypes.h>
 
+#define NUM_GPIOS 54
+
+static alertFunc_t alert_funcs[NUM_GPIOS];
+
+// the stubs log to stderr, stdout belongs to the program linking them in, such as emulate's
+// register dump
+int gpioCfgSetInternals(unsigned cfgVal) {
+    fprintf(stderr, "[STUB] gpioCfgSetInternals(cfgVal=%u)\n", cfgVal);
+    return 0;
+}
+
 int gpioInitialise(void) {
-    printf("[STUB] gpioInitialise()\n");
+    fprintf(stderr, "[STUB] gpioInitialise()\n");
     return 0;
 }
 
 void gpioTerminate(void) {
-    printf("[STUB] gpioTerminate()\n");
+    fprintf(stderr, "[STUB] gpioTerminate()\n");
 }
 
 void gpioSetMode(unsigned gpio, unsigned mode) {
-    printf("[STUB] gpioSetMode(gpio=%u, mode=%u)\n", gpio, mode);
+    fprintf(stderr, "[STUB] gpioSetMode(gpio=%u, mode=%u)\n", gpio, mode);
 }
 
 void gpioSetPullUpDown(unsigned gpio, unsigned pud) {
-    printf("[STUB] gpioSetPullUpDown(gpio=%u, pud=%u)\n", gpio, pud);
+    fprintf(stderr, "[STUB] gpioSetPullUpDown(gpio=%u, pud=%u)\n", gpio, pud);
 }
 
 void gpioSetAlertFunc(unsigned gpio, alertFunc_t f) {
-    printf("[STUB] gpioSetAlertFunc(gpio=%u, f=%#" PRIxPTR ")\n", gpio, (uintptr_t)f);
+    fprintf(stderr, "[STUB] gpioSetAlertFunc(gpio=%u, f=%#" PRIxPTR ")\n", gpio, (uintptr_t)f);
+    if (gpio < NUM_GPIOS) alert_funcs[gpio] = f;
+}
+
+// pretends {gpio} changed to {level}, calling its alert function like pigpio would. ticks are
+// microseconds on the virtual clock
+void gpioEmuAlert(unsigned gpio, int level) {
+    if (gpio < NUM_GPIOS && alert_funcs[gpio]) {
+        alert_funcs[gpio](gpio, level, (uint32_t)vclock_now_us());
+    }
 }
 
 int gpioWrite(unsigned gpio, unsigned level) {
-    printf("[STUB] gpioWrite(gpio=%u, level=%u)\n", gpio, level);
+    fprintf(stderr, "[STUB] gpioWrite(gpio=%u, level=%u)\n", gpio, level);
     return 0;
 }
 
 int i2cOpen(unsigned bus, unsigned addr, unsigned flags) {
-    printf("[STUB] i2cOpen(bus=%u, addr=0x%x, flags=%u)\n", bus, addr, flags);
+    fprintf(stderr, "[STUB] i2cOpen(bus=%u, addr=0x%x, flags=%u)\n", bus, addr, flags);
     return 42; // fake handle
 }
 
 int i2cClose(unsigned handle) {
-    printf("[STUB] i2cClose(handle=%d)\n", handle);
+    fprintf(stderr, "[STUB] i2cClose(handle=%d)\n", handle);
     return 0;
 }
 
 int i2cWriteByte(unsigned handle, uint8_t b) {
-    printf("[STUB] i2cWriteByte(handle=%d, byte=0x%02x)\n", handle, b);
+    fprintf(stderr, "[STUB] i2cWriteByte(handle=%d, byte=0x%02x)\n", handle, b);
     return 0;
 }
 
 void gpioDelay(unsigned us) {
-    // usleep is in microseconds
-    usleep(us);
+    vclock_sleep_us(us);
 }
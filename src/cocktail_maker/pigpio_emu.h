@@ -6,14 +6,17 @@
 #define PI_OUTPUT 1
 #define PI_INPUT 0
 #define PI_PUD_DOWN 2
+#define PI_CFG_NOSIGHANDLER (1 << 10)
 
 typedef void (*alertFunc_t)(int gpio, int level, uint32_t tick);
 
+int gpioCfgSetInternals(unsigned cfgVal);
 int gpioInitialise(void);
 void gpioTerminate(void);
 void gpioSetMode(unsigned gpio, unsigned mode);
 void gpioSetPullUpDown(unsigned gpio, unsigned pud);
 void gpioSetAlertFunc(unsigned gpio, alertFunc_t f);
+void gpioEmuAlert(unsigned gpio, int level);
 int gpioWrite(unsigned gpio, unsigned level);
 
 int i2cOpen(unsigned bus, unsigned addr, unsigned flags);
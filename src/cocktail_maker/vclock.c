@@ -0,0 +1,230 @@
+#include "vclock.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// a thread blocked in vclock_wait(), on its own stack
+typedef struct Waiter {
+    VClockSem *sem; // NULL when only sleeping
+    uint64_t deadline;
+    bool done; // may run again
+    bool posted; // woken by a post rather than the deadline
+    struct Waiter *next;
+} Waiter;
+
+// a thread being started by vclock_thread_create()
+typedef struct {
+    void *(*fn)(void *);
+    void *arg;
+    bool registered;
+} Start;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool simulated;
+    uint64_t now; // simulated time since vclock_init()
+    time_t epoch; // wall clock time at simulated 0
+    Waiter *waiters; // blocked, in the order they started waiting
+    Waiter *ready; // simulated: woken but not running yet, in the order they were woken
+} vclock = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t wake_initialised = PTHREAD_ONCE_INIT;
+
+// timed waits run on the monotonic clock, so the wall clock being stepped, as NTP does to a Pi
+// without an RTC after boot, cannot end a pour early or late
+static void init_wake(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&vclock.wake, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void lock(void) {
+    pthread_once(&wake_initialised, init_wake);
+    pthread_mutex_lock(&vclock.lock);
+}
+
+static uint64_t real_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * US_PER_SEC + ts.tv_nsec / 1000;
+}
+
+// picks the clock, before any other thread uses it. without a call the clock is the real one
+void vclock_init(bool simulated) {
+    vclock.simulated = simulated;
+    vclock.now = 0;
+    vclock.epoch = time(NULL);
+}
+
+bool vclock_simulated(void) {
+    return vclock.simulated;
+}
+
+uint64_t vclock_now_us(void) {
+    if (!vclock.simulated) return real_now_us();
+    lock();
+    uint64_t now = vclock.now;
+    pthread_mutex_unlock(&vclock.lock);
+    return now;
+}
+
+// wall clock time, for timestamps
+time_t vclock_time(void) {
+    return vclock.simulated ? vclock.epoch + (time_t)(vclock_now_us() / US_PER_SEC) : time(NULL);
+}
+
+static void append(Waiter **list, Waiter *w) {
+    while (*list) list = &(*list)->next;
+    w->next = NULL;
+    *list = w;
+}
+
+static void unlink_waiter(Waiter *w) {
+    Waiter **p = &vclock.waiters;
+    while (*p != w) p = &(*p)->next;
+    *p = w->next;
+}
+
+// takes {w} off the waiters. the real clock lets it run straight away, the simulated one queues
+// it until the clock is free
+static void wake_waiter(Waiter *w, bool posted) {
+    unlink_waiter(w);
+    w->posted = posted;
+    if (vclock.simulated) {
+        append(&vclock.ready, w);
+        return;
+    }
+    w->done = true;
+    pthread_cond_broadcast(&vclock.wake);
+}
+
+// everyone is waiting, so moves simulated time to the earliest deadline and readies whoever
+// waits for it, in the order they started waiting. lock held
+static void advance(void) {
+    uint64_t next = VCLOCK_FOREVER;
+    for (Waiter *w = vclock.waiters; w; w = w->next) {
+        if (w->deadline < next) next = w->deadline;
+    }
+    if (next == VCLOCK_FOREVER) {
+        fprintf(stderr, "Simulated clock stuck: every thread waits without a deadline\n");
+        abort();
+    }
+    vclock.now = next;
+    Waiter *w = vclock.waiters;
+    while (w) {
+        Waiter *next_waiter = w->next;
+        if (w->deadline <= vclock.now) wake_waiter(w, false);
+        w = next_waiter;
+    }
+}
+
+// the thread holding the simulated clock has blocked or finished, so hands the clock to the
+// first ready thread, moving time on if there is none. only one thread taking part runs at a
+// time, so a script always gives the same events in the same order. lock held
+static void dispatch(void) {
+    if (!vclock.ready) advance();
+    Waiter *w = vclock.ready;
+    vclock.ready = w->next;
+    w->done = true;
+    pthread_cond_broadcast(&vclock.wake);
+}
+
+// waits for the host clock to reach {deadline} or to be woken, lock held
+static void real_wait(Waiter *w) {
+    if (w->deadline == VCLOCK_FOREVER) {
+        pthread_cond_wait(&vclock.wake, &vclock.lock);
+        return;
+    }
+    if (real_now_us() >= w->deadline) {
+        wake_waiter(w, false);
+        return;
+    }
+    struct timespec until = {
+        .tv_sec = w->deadline / US_PER_SEC,
+        .tv_nsec = (w->deadline % US_PER_SEC) * 1000,
+    };
+    // a timeout is only trusted once the clock agrees, the loop around comes back otherwise
+    if (pthread_cond_timedwait(&vclock.wake, &vclock.lock, &until) == ETIMEDOUT && !w->done &&
+        real_now_us() >= w->deadline)
+        wake_waiter(w, false);
+}
+
+// takes a post from {sem}, waiting until {deadline_us} at most for one. with a NULL {sem} it only
+// waits for the deadline. true if a post was taken
+bool vclock_wait(VClockSem *sem, uint64_t deadline_us) {
+    lock();
+    if (sem && sem->count > 0) {
+        --sem->count;
+        pthread_mutex_unlock(&vclock.lock);
+        return true;
+    }
+    Waiter w = {.sem = sem, .deadline = deadline_us};
+    append(&vclock.waiters, &w);
+    if (vclock.simulated) dispatch();
+    while (!w.done) {
+        if (vclock.simulated)
+            pthread_cond_wait(&vclock.wake, &vclock.lock);
+        else
+            real_wait(&w);
+    }
+    pthread_mutex_unlock(&vclock.lock);
+    return w.posted;
+}
+
+// wakes the longest waiting thread on {sem}, or leaves the post for the next wait. on the
+// simulated clock the woken thread gets to run once the poster blocks
+void vclock_post(VClockSem *sem) {
+    lock();
+    Waiter *w = vclock.waiters;
+    while (w && w->sem != sem) w = w->next;
+    if (w)
+        wake_waiter(w, true);
+    else
+        ++sem->count;
+    pthread_mutex_unlock(&vclock.lock);
+}
+
+void vclock_sleep_us(uint64_t us) {
+    vclock_wait(NULL, vclock_now_us() + us);
+}
+
+// queues the new thread behind the ready ones on the simulated clock and waits for its turn,
+// then hands the clock on once {fn} returns
+static void *thread_main(void *arg) {
+    Start *start = arg;
+    void *(*fn)(void *) = start->fn;
+    void *fn_arg = start->arg;
+    Waiter w = {.deadline = VCLOCK_FOREVER};
+    lock();
+    if (vclock.simulated)
+        append(&vclock.ready, &w);
+    else
+        w.done = true;
+    start->registered = true;
+    pthread_cond_broadcast(&vclock.wake);
+    while (!w.done) pthread_cond_wait(&vclock.wake, &vclock.lock);
+    pthread_mutex_unlock(&vclock.lock);
+
+    void *result = fn(fn_arg);
+
+    lock();
+    if (vclock.simulated) dispatch();
+    pthread_mutex_unlock(&vclock.lock);
+    return result;
+}
+
+// starts a detached thread taking part in the clock, running {fn}({arg}). it is queued before
+// this returns, so threads started one after another first run in that order
+bool vclock_thread_create(void *(*fn)(void *), void *arg) {
+    Start start = {.fn = fn, .arg = arg};
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_main, &start) != 0) return false;
+    pthread_detach(tid);
+    lock();
+    while (!start.registered) pthread_cond_wait(&vclock.wake, &vclock.lock);
+    pthread_mutex_unlock(&vclock.lock);
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef VCLOCK_H
+#define VCLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define US_PER_SEC 1000000ULL
+#define VCLOCK_FOREVER UINT64_MAX
+
+// the clock everything in the cocktail maker waits on, in microseconds.
+// the real clock follows the host's monotonic clock. the simulated one hands itself from thread
+// to thread, so only one thread taking part runs at a time. once it blocks, the next woken thread
+// runs, and once every thread waits, time jumps straight to the earliest deadline. a session of
+// hundreds of pours runs in milliseconds, with the same events in the same order every time.
+// threads other than main take part by being started with vclock_thread_create(), and must only
+// block through vclock_wait() or vclock_sleep_us()
+
+// posts not taken by a wait yet
+typedef struct {
+    unsigned count;
+} VClockSem;
+
+#define VCLOCK_SEM_INIT {0}
+
+void vclock_init(bool simulated);
+bool vclock_simulated(void);
+
+uint64_t vclock_now_us(void);
+time_t vclock_time(void);
+void vclock_sleep_us(uint64_t us);
+
+bool vclock_wait(VClockSem *sem, uint64_t deadline_us);
+void vclock_post(VClockSem *sem);
+
+bool vclock_thread_create(void *(*fn)(void *), void *arg);
+
+#endif
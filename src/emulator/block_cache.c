@@ -0,0 +1,119 @@
+#include "block_cache.h"
+#include "emu_memory.h"
+#include "fde.h"
+#include "jit.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CACHE_INDEX(pc) (((pc) >> 2) & (BLOCK_CACHE_SIZE - 1))
+
+static BlockCacheState default_blocks;
+_Thread_local BlockCacheState *cur_blocks = &default_blocks;
+
+static void code_written(uint32_t addr, size_t size) {
+	cur_blocks->dirty = true;
+	__atomic_fetch_add(&cur_memory->code_writes, 1, __ATOMIC_RELEASE);
+}
+
+void block_cache_init(void) {
+	if (!cur_blocks->arena) {
+		cur_blocks->arena = malloc(BLOCK_ARENA_SIZE);
+		assert(cur_blocks->arena);
+	}
+	mem_set_code_hook(code_written);
+	block_cache_flush();
+}
+
+// shared memory keeps its hook and marks for the cores still running on it
+void block_cache_destroy(void) {
+	if (!cur_memory->shared) {
+		mem_set_code_hook(NULL);
+		mem_clear_code_marks();
+	}
+	free(cur_blocks->arena);
+	cur_blocks->arena = NULL;
+}
+
+// drops every translated block, only safe between blocks. code marks in shared memory stay, as
+// other cores may still run blocks decoded from there
+void block_cache_flush(void) {
+	BlockCacheState *c = cur_blocks;
+	for (size_t i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+		c->cache[i] = NULL;
+	}
+	c->arena_used = 0;
+	c->generation++;
+	jit_flush();
+	if (!cur_memory->shared)
+		mem_clear_code_marks();
+	c->code_writes_seen = __atomic_load_n(&cur_memory->code_writes, __ATOMIC_ACQUIRE);
+	c->dirty = false;
+}
+
+static Block *translate(uint32_t pc) {
+	BlockCacheState *c = cur_blocks;
+	// worst case is a full block plus its end marker
+	if (c->arena_used + sizeof(Block) + (BLOCK_MAX_INSTRS + 1) * sizeof(DecodedInstr) >
+		BLOCK_ARENA_SIZE)
+		block_cache_flush();
+	Block *block = (Block *)(c->arena + c->arena_used);
+	*block = (Block){.start = pc};
+
+	DecodedInstr *d = block->instrs;
+	uint32_t addr = pc;
+	bool ended = false;
+	// the first instruction is always fetched, so running off the end of memory still asserts
+	while (!ended && block->length < BLOCK_MAX_INSTRS &&
+		   (block->length == 0 || addr + 4 <= MEMORY_SIZE)) {
+		uint32_t instr = mem_load32(addr);
+		if (IS_HALT(instr)) { // halt itself is never executed, the block stops in front of it
+			block->halts = true;
+			break;
+		}
+		mem_mark_code(addr);
+		decode(instr, addr, d);
+		ended = ENDS_BLOCK(d->cls);
+		block->length++;
+		addr += 4;
+		d++;
+	}
+	if (!ended) {
+		decode_block_end(addr, d);
+		d++;
+	}
+
+	c->arena_used = (uint8_t *)d - c->arena;
+	c->cache[CACHE_INDEX(pc)] = block;
+	return block;
+}
+
+Block *block_cache_lookup(uint32_t pc) {
+	Block *block = cur_blocks->cache[CACHE_INDEX(pc)];
+	if (block && block->start == pc)
+		return block;
+	return translate(pc);
+}
+
+// finds the block after {block} at {pc}, following and updating its chain
+Block *block_cache_next(Block *block, uint32_t pc) {
+	if (block_cache_stale()) {
+		block_cache_flush();
+		return translate(pc);
+	}
+	if (block->next[0] && block->next[0]->start == pc)
+		return block->next[0];
+	if (block->next[1] && block->next[1]->start == pc)
+		return block->next[1];
+
+	unsigned old_generation = cur_blocks->generation;
+	Block *next = block_cache_lookup(pc);
+	// translation may have flushed the arena, taking {block} with it
+	if (cur_blocks->generation == old_generation) {
+		block->next[1] = block->next[0];
+		block->next[0] = next;
+	}
+	return next;
+}
@@ -0,0 +1,60 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "emu_memory.h"
+#include "fde.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_CACHE_SIZE 4096	   // lookup table entries, must be a power of 2
+#define BLOCK_ARENA_SIZE (1 << 20) // bytes of translated blocks kept before starting over
+#define BLOCK_MAX_INSTRS 64
+
+// block compiled to host code, takes the register file and returns the pc to continue at
+typedef uint64_t (*NativeBlock)(uint64_t *registers);
+
+// straight-line run of decoded instructions, ending at a branch, a halt or an unknown instruction
+typedef struct Block {
+	uint32_t start;		   // pc of the first instruction
+	uint32_t length;	   // instructions executed by the block
+	bool halts;			   // whether the block runs up to a halt
+	uint32_t runs;		   // interpreted runs, to find blocks worth compiling
+	NativeBlock native;	   // compiled version of the block, if any
+	struct Block *next[2]; // last successors, so chained blocks need no lookup
+	DecodedInstr instrs[]; // ends with an instruction whose class ENDS_BLOCK
+} Block;
+
+// translated blocks of one emulated machine, all functions below work on cur_blocks
+typedef struct BlockCacheState {
+	// set when a store hits translated code, the cache is then flushed at the next block boundary
+	bool dirty;
+	// blocks are bump-allocated and only ever freed all at once, so chained pointers stay valid
+	uint8_t *arena;
+	size_t arena_used;
+	unsigned generation;	   // bumped on every flush
+	unsigned code_writes_seen; // cur_memory->code_writes at the last flush
+	// direct-mapped from start pc, a block evicted from here stays reachable through chains
+	Block *cache[BLOCK_CACHE_SIZE];
+} BlockCacheState;
+
+// selected per thread, a single-core program can just use the default one
+extern _Thread_local BlockCacheState *cur_blocks;
+
+void block_cache_init(void);
+void block_cache_destroy(void);
+
+Block *block_cache_lookup(uint32_t pc);
+Block *block_cache_next(Block *block, uint32_t pc);
+void block_cache_flush(void);
+
+// whether a store into code, by this core or another sharing its memory, has made translated
+// blocks out of date, they are then flushed at the next block boundary
+static inline bool block_cache_stale(void) {
+	return cur_blocks->dirty || __atomic_load_n(&cur_memory->code_writes, __ATOMIC_ACQUIRE) !=
+									cur_blocks->code_writes_seen;
+}
+
+static inline void block_run(const Block *block) { block->instrs[0].handler(&block->instrs[0]); }
+
+#endif
@@ -0,0 +1,314 @@
+#include "cpu.h"
+#include "block_cache.h"
+#include "emu_memory.h"
+#include "emu_registers.h"
+#include "fde.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// start of a snapshot file, padded to a page so the saved pages after it can be mapped directly.
+// only meant to be restored on the host that saved it, so fields are in host byte order
+typedef struct SnapshotHeader {
+	char magic[8];
+	uint64_t registers[NUM_REGISTERS];
+	uint64_t pc;
+	uint64_t instructions;
+	uint8_t nzcv;
+	uint8_t page_map[MEM_NUM_PAGES / 8]; // pages saved after the header, in address order
+} SnapshotHeader;
+
+#define SNAPSHOT_HEADER_SIZE (1 << MEM_PAGE_SHIFT)
+_Static_assert(sizeof(SnapshotHeader) <= SNAPSHOT_HEADER_SIZE, "snapshot header exceeds a page");
+
+// creates a machine with cleared state and binds it to the calling thread
+CpuState *cpu_create(bool use_jit) {
+	CpuState *cpu = calloc(1, sizeof(CpuState));
+	assert(cpu);
+	cpu_bind(cpu);
+	mem_init();
+	block_cache_init();
+	cpu->use_jit = use_jit && jit_init();
+	cpu_reset(cpu);
+	return cpu;
+}
+
+// creates another core of the machine {primary}, with its own registers, block cache and JIT but
+// running on the memory of {primary}, and binds it to the calling thread. it has to be destroyed
+// before {primary}
+CpuState *cpu_create_core(CpuState *primary, bool use_jit) {
+	CpuState *cpu = calloc(1, sizeof(CpuState));
+	assert(cpu);
+	cpu->primary = primary;
+	primary->memory.shared = true;
+	cpu_bind(cpu);
+	block_cache_init();
+	cpu->use_jit = use_jit && jit_init();
+	cpu_reset(cpu);
+	return cpu;
+}
+
+// the calling thread has to bind another machine before emulating anything else
+void cpu_destroy(CpuState *cpu) {
+	cpu_bind(cpu);
+	jit_destroy();
+	block_cache_destroy();
+	if (!cpu->primary)
+		mem_destroy();
+	registers_destroy();
+	free(cpu);
+}
+
+// makes {cpu} the machine the calling thread emulates
+void cpu_bind(CpuState *cpu) {
+	cur_registers = &cpu->registers;
+	cur_memory = cpu->primary ? &cpu->primary->memory : &cpu->memory;
+	cur_blocks = &cpu->blocks;
+	cur_jit = &cpu->jit;
+}
+
+// clears registers and memory and drops translated code, ready for the next program. a core
+// created by cpu_create_core() leaves the memory it shares alone
+void cpu_reset(CpuState *cpu) {
+	cpu_bind(cpu);
+	block_cache_flush();
+	if (!cpu->primary)
+		mem_reset();
+	registers_init();
+	cpu->instructions = 0;
+	setZ(1);
+	setN(0);
+	setC(0);
+	setV(0);
+}
+
+// resets {cpu} and loads the bin file {filename} into it, false if it could not be opened
+bool cpu_load(CpuState *cpu, char *filename) {
+	cpu_reset(cpu);
+	return binary_loader(filename);
+}
+
+// executes the single instruction at pc, false if pc is at a halt, which is never executed
+bool cpu_step(CpuState *cpu) {
+	cpu_bind(cpu);
+	uint32_t instr = fetch();
+	if (IS_HALT(instr))
+		return false;
+	if (cpu->trace)
+		trace_step(cpu->trace, instr);
+	else if (cpu->profile)
+		profile_step(cpu->profile, instr);
+	else
+		decode_and_execute(instr);
+	cpu->instructions++;
+	if (block_cache_stale()) // between blocks, so translated code can go right away
+		block_cache_flush();
+	return true;
+}
+
+// steps through a block that would run through {stop_pc} or past {limit} executed instructions,
+// so execution stops exactly there
+static CpuStopReason step_until(CpuState *cpu, uint64_t stop_pc, uint64_t limit) {
+	while (pc_load() != stop_pc) {
+		if (cpu->instructions >= limit)
+			return CPU_BUDGET_EXHAUSTED;
+		if (!cpu_step(cpu))
+			return CPU_HALTED;
+	}
+	return CPU_REACHED_PC;
+}
+
+// whether {block} ran all the way up to its halt, rather than being left early after a store
+static inline bool reached_halt(const Block *block) {
+	return block->halts && pc_load() == block->start + 4 * block->length;
+}
+
+// runs blocks from the current pc until a halt, until pc is {stop_pc} or until {max_instrs} more
+// instructions have executed, compiling hot blocks if enabled. the budget is checked once per
+// block, and only a block that would run through {stop_pc} or past the budget is executed an
+// instruction at a time. with a profile set, every block run is counted. with a trace set,
+// everything is executed an instruction at a time, and a profile is left untouched
+CpuStopReason cpu_run_until(CpuState *cpu, uint64_t stop_pc, uint64_t max_instrs) {
+	cpu_bind(cpu);
+	uint64_t limit = max_instrs > CPU_NO_LIMIT - cpu->instructions ? CPU_NO_LIMIT
+																	 : cpu->instructions + max_instrs;
+	if (block_cache_stale()) // code was written since the last run
+		block_cache_flush();
+	if (cpu->trace)
+		return step_until(cpu, stop_pc, limit);
+	Block *block = block_cache_lookup((uint32_t)pc_load());
+	while (1) {
+		if (stop_pc - block->start < 4 * (uint64_t)block->length ||
+			limit - cpu->instructions < block->length)
+			return step_until(cpu, stop_pc, limit);
+		bool native = block->native;
+		if (native)
+			pc_store(block->native(register_file()));
+		else
+			block_run(block);
+		// a store into code leaves the block right after the store
+		uint64_t executed =
+			cur_blocks->dirty ? (pc_load() - block->start) / 4 : (uint64_t)block->length;
+		cpu->instructions += executed;
+		if (cpu->profile)
+			profile_block(cpu->profile, block, executed);
+		if (!native && cpu->use_jit && ++block->runs == JIT_THRESHOLD)
+			jit_compile(block);
+		if (reached_halt(block))
+			return CPU_HALTED;
+		block = block_cache_next(block, (uint32_t)pc_load());
+	}
+}
+
+void cpu_run(CpuState *cpu) { cpu_run_until(cpu, CPU_NO_STOP_PC, CPU_NO_LIMIT); }
+
+uint64_t cpu_instructions(CpuState *cpu) { return cpu->instructions; }
+
+uint64_t cpu_register(CpuState *cpu, unsigned reg) {
+	cpu_bind(cpu);
+	return register_load_x(reg);
+}
+
+void cpu_set_register(CpuState *cpu, unsigned reg, uint64_t value) {
+	cpu_bind(cpu);
+	register_store_x(reg, value);
+}
+
+uint64_t cpu_pc(CpuState *cpu) { return cpu->registers.pc; }
+
+void cpu_set_pc(CpuState *cpu, uint64_t pc) { cpu->registers.pc = pc; }
+
+uint32_t cpu_read32(CpuState *cpu, uint32_t addr) {
+	cpu_bind(cpu);
+	return mem_load32(addr);
+}
+
+// stores into translated code are picked up by the next run
+void cpu_write32(CpuState *cpu, uint32_t addr, uint32_t value) {
+	cpu_bind(cpu);
+	mem_store32(addr, value);
+}
+
+// writes registers, pc, flags and non-zero memory in the final state format, all formatted into
+// one buffer first and written with a single fwrite
+void cpu_export(CpuState *cpu, FILE *out) {
+	cpu_bind(cpu);
+	char *buffer = malloc(REGISTERS_EXPORT_SIZE + mem_export_size());
+	assert(buffer);
+	char *end = format_memory(format_registers(buffer));
+	fwrite(buffer, 1, end - buffer, out);
+	free(buffer);
+}
+
+// compares {cpu} against the final state file {ref_file}, as written by cpu_export(), reporting
+// every register, flag and memory word that differs to {report}. returns how many differed, or
+// -1 if {ref_file} could not be read
+long cpu_diff(CpuState *cpu, const char *ref_file, FILE *report) {
+	cpu_bind(cpu);
+	FILE *ref = fopen(ref_file, "r");
+	if (!ref)
+		return -1;
+	uint8_t *ref_memory = calloc(MEMORY_SIZE, 1);
+	uint8_t ref_pages[MEM_NUM_PAGES / 8] = {0};
+	assert(ref_memory);
+	uint64_t ref_registers[NUM_REGISTERS] = {0};
+	uint64_t ref_pc = 0;
+	char ref_pstate[5] = "----";
+
+	char line[128];
+	unsigned reg;
+	uint64_t value;
+	uint32_t addr, word;
+	while (fgets(line, sizeof(line), ref)) {
+		if (sscanf(line, "X%u = %" SCNx64, &reg, &value) == 2 && reg < NUM_REGISTERS) {
+			ref_registers[reg] = value;
+		} else if (sscanf(line, "PC = %" SCNx64, &value) == 1) {
+			ref_pc = value;
+		} else if (sscanf(line, "PSTATE : %4s", ref_pstate) == 1) {
+			continue;
+		} else if (sscanf(line, "0x%" SCNx32 ": %" SCNx32, &addr, &word) == 2 &&
+				   addr <= MEMORY_SIZE - 4) {
+			word = MEM_LE32(word);
+			memcpy(ref_memory + addr, &word, sizeof(word));
+			ref_pages[(addr >> MEM_PAGE_SHIFT) / 8] |= 1 << ((addr >> MEM_PAGE_SHIFT) % 8);
+		}
+	}
+	fclose(ref);
+
+	long mismatches = 0;
+	for (unsigned i = 0; i < NUM_REGISTERS; ++i) {
+		if (register_load_x(i) != ref_registers[i]) {
+			fprintf(report, "X%02u = %016" PRIx64 ", expected %016" PRIx64 "\n", i,
+					register_load_x(i), ref_registers[i]);
+			mismatches++;
+		}
+	}
+	if (pc_load() != ref_pc) {
+		fprintf(report, "PC = %016" PRIx64 ", expected %016" PRIx64 "\n", pc_load(), ref_pc);
+		mismatches++;
+	}
+	char pstate[5] = {getN() ? 'N' : '-', getZ() ? 'Z' : '-', getC() ? 'C' : '-',
+					  getV() ? 'V' : '-', '\0'};
+	if (strcmp(pstate, ref_pstate)) {
+		fprintf(report, "PSTATE : %s, expected %s\n", pstate, ref_pstate);
+		mismatches++;
+	}
+	mismatches += mem_diff(ref_memory, ref_pages, report);
+	free(ref_memory);
+	return mismatches;
+}
+
+// writes registers, pc, flags and the written pages of {cpu} to {filename}, false if it fails
+bool cpu_save(CpuState *cpu, const char *filename) {
+	cpu_bind(cpu);
+	FILE *out = fopen(filename, "wb");
+	if (!out)
+		return false;
+	static const uint8_t padding[SNAPSHOT_HEADER_SIZE];
+	SnapshotHeader header = {.magic = CPU_SNAPSHOT_MAGIC,
+							 .pc = pc_load(),
+							 .instructions = cpu->instructions,
+							 .nzcv = getN() << 3 | getZ() << 2 | getC() << 1 | getV()};
+	memcpy(header.registers, register_file(), sizeof(header.registers));
+	memcpy(header.page_map, cur_memory->dirty_map, sizeof(header.page_map));
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+			  fwrite(padding, 1, SNAPSHOT_HEADER_SIZE - sizeof(header), out) ==
+				  SNAPSHOT_HEADER_SIZE - sizeof(header) &&
+			  mem_save_pages(out);
+	return fclose(out) == 0 && ok;
+}
+
+// resets {cpu} to the state saved in {filename}, mapping its pages rather than reading them.
+// false if it is not a snapshot, which leaves {cpu} reset
+bool cpu_restore(CpuState *cpu, const char *filename) {
+	cpu_reset(cpu);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	SnapshotHeader header;
+	bool ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+			  !memcmp(header.magic, CPU_SNAPSHOT_MAGIC, sizeof(header.magic)) &&
+			  mem_map_pages(fd, SNAPSHOT_HEADER_SIZE, header.page_map);
+	close(fd); // mappings stay valid without the descriptor
+	if (!ok) {
+		cpu_reset(cpu);
+		return false;
+	}
+	memcpy(register_file(), header.registers, sizeof(header.registers));
+	pc_store(header.pc);
+	cpu->instructions = header.instructions;
+	setN(header.nzcv & 8);
+	setZ(header.nzcv & 4);
+	setC(header.nzcv & 2);
+	setV(header.nzcv & 1);
+	return true;
+}
@@ -0,0 +1,64 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "block_cache.h"
+#include "emu_memory.h"
+#include "emu_registers.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CPU_NO_STOP_PC UINT64_MAX
+#define CPU_NO_LIMIT UINT64_MAX
+#define CPU_SNAPSHOT_MAGIC "ARMSNAP1"
+
+// why cpu_run_until() returned
+typedef enum { CPU_HALTED, CPU_REACHED_PC, CPU_BUDGET_EXHAUSTED } CpuStopReason;
+
+// everything one emulated machine needs. the emulator works on whichever CpuState is bound to
+// the calling thread, so separate machines can run on separate threads without locking.
+// every function below taking a CpuState binds it first, so embedders never need cpu_bind()
+typedef struct CpuState {
+	RegisterState registers;
+	MemoryState memory;
+	BlockCacheState blocks;
+	JitState jit;
+	bool use_jit; // compile hot blocks, only set if the JIT is available on this host
+	uint64_t instructions; // executed since the last reset
+	Profile *profile;	   // counts executed instructions by class and pc when set, not owned
+	Trace *trace;		   // records every instruction when set, not owned
+	// core whose memory this one runs on, see cpu_create_core(). NULL if it has its own
+	struct CpuState *primary;
+} CpuState;
+
+CpuState *cpu_create(bool use_jit);
+CpuState *cpu_create_core(CpuState *primary, bool use_jit);
+void cpu_destroy(CpuState *cpu);
+
+void cpu_bind(CpuState *cpu);
+void cpu_reset(CpuState *cpu);
+bool cpu_load(CpuState *cpu, char *filename);
+
+bool cpu_step(CpuState *cpu);
+CpuStopReason cpu_run_until(CpuState *cpu, uint64_t stop_pc, uint64_t max_instrs);
+void cpu_run(CpuState *cpu);
+
+uint64_t cpu_instructions(CpuState *cpu);
+uint64_t cpu_register(CpuState *cpu, unsigned reg);
+void cpu_set_register(CpuState *cpu, unsigned reg, uint64_t value);
+uint64_t cpu_pc(CpuState *cpu);
+void cpu_set_pc(CpuState *cpu, uint64_t pc);
+uint32_t cpu_read32(CpuState *cpu, uint32_t addr);
+void cpu_write32(CpuState *cpu, uint32_t addr, uint32_t value);
+
+void cpu_export(CpuState *cpu, FILE *out);
+
+long cpu_diff(CpuState *cpu, const char *ref_file, FILE *report);
+
+bool cpu_save(CpuState *cpu, const char *filename);
+bool cpu_restore(CpuState *cpu, const char *filename);
+
+#endif
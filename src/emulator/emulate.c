@@ -1,65 +1,432 @@
-#include "bit_utils.h"
-#include "emu_memory.h"
-#include "emu_registers.h"
-#include "fde.h"
-#include "instructions.h"
+#include "cpu.h"
+#include "gpio_device.h"
+#include "smp.h"
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#define IS_HALT(instruction) ((instruction) == 0x8a000000)
+// programs of a batch run, each worker takes the next one nobody has started yet
+typedef struct {
+	char **in_files;
+	char **out_files;
+	size_t count;
+	atomic_size_t next;
+	atomic_int failures;
+	atomic_uint_least64_t instructions; // executed by all programs together
+	bool use_jit;
+	bool gpio; // map the GPIO and I2C controllers into every machine
+	uint64_t max_instrs;
+	Profile *profile; // all workers' counts together, if profiling
+	pthread_mutex_t profile_lock;
+} Batch;
 
-int main(int argc, char **argv) {
-	assert(argc >= 2);
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	registers_init();
-	mem_init();
+static void print_stats(uint64_t instructions, uint64_t ns) {
+	double seconds = ns / 1e9;
+	fprintf(stderr, "%" PRIu64 " instructions in %.6f s, %.1f MIPS\n", instructions, seconds,
+			seconds > 0 ? instructions / seconds / 1e6 : 0.0);
+}
+
+// opens {out_file}, appending .out unless it already ends in it, or stdout if there is none
+static FILE *open_output(const char *out_file) {
+	if (!out_file)
+		return stdout;
+	size_t outLen = strlen(out_file);
+	if (outLen >= 4 && !strcmp(out_file + outLen - 4, ".out"))
+		return fopen(out_file, "w");
+	char *new = malloc(outLen + 5);
+	strcpy(new, out_file);
+	strcat(new, ".out");
+	FILE *out = fopen(new, "w");
+	free(new);
+	return out;
+}
 
-	binary_loader(argv[1]);
+// runs the program loaded into {cpu}. a program that has not halted after {max_instrs}
+// instructions in total is stopped there and fails. how long running it took is put in {run_ns}
+static bool run_program(CpuState *cpu, const char *name, uint64_t max_instrs, uint64_t *run_ns) {
+	uint64_t start = now_ns();
+	uint64_t done = cpu_instructions(cpu);
+	bool halted = cpu_run_until(cpu, CPU_NO_STOP_PC, max_instrs > done ? max_instrs - done : 0) ==
+				  CPU_HALTED;
+	*run_ns = now_ns() - start;
+	if (!halted)
+		fprintf(stderr, "%s: no halt within %" PRIu64 " instructions\n", name, max_instrs);
+	return halted;
+}
+
+// writes the final state of {cpu} to {out_file}, or to stdout if there is none
+static bool export_state(CpuState *cpu, const char *out_file) {
+	FILE *out = open_output(out_file);
+	if (out == NULL)
+		return false;
+	cpu_export(cpu, out);
+	if (out != stdout)
+		fclose(out);
+	return true;
+}
 
-	setZ(1);
-	setN(0);
-	setC(0);
-	setV(0);
-	while (1) {
-		uint32_t instr = fetch();
-		if (IS_HALT(instr))
+// loads {in_file} into {cpu} from a clean state, runs it like run_program() and writes its final
+// state to {out_file}, even if it did not halt
+static bool emulate_file(CpuState *cpu, char *in_file, const char *out_file, uint64_t max_instrs,
+						 uint64_t *run_ns) {
+	if (!cpu_load(cpu, in_file))
+		return false;
+	bool halted = run_program(cpu, in_file, max_instrs, run_ns);
+	return export_state(cpu, out_file) && halted;
+}
+
+// reports how the final state of {cpu} differs from {ref_file} to stderr, true if it does not
+static bool diff_state(CpuState *cpu, const char *ref_file) {
+	long differences = cpu_diff(cpu, ref_file, stderr);
+	if (differences < 0)
+		perror("Failed to open reference state");
+	else if (differences > 0)
+		fprintf(stderr, "%ld differences against %s\n", differences, ref_file);
+	return differences == 0;
+}
+
+// loads {in_file}, runs its first {count} instructions and saves the state reached to
+// {snapshot_file}, so runs sharing that prefix can --restore it instead
+static bool snapshot_prefix(CpuState *cpu, char *in_file, uint64_t count,
+							const char *snapshot_file) {
+	if (!cpu_load(cpu, in_file))
+		return false;
+	cpu_run_until(cpu, CPU_NO_STOP_PC, count);
+	if (!cpu_save(cpu, snapshot_file)) {
+		fprintf(stderr, "Failed to write snapshot %s\n", snapshot_file);
+		return false;
+	}
+	return true;
+}
+
+// maps the GPIO and I2C controllers into the machine bound to the calling thread
+static bool map_gpio(void) {
+	if (gpio_device_map())
+		return true;
+	fprintf(stderr, "Failed to map the GPIO controllers\n");
+	return false;
+}
+
+static void *batch_worker(void *arg) {
+	Batch *batch = arg;
+	CpuState *cpu = cpu_create(batch->use_jit);
+	if (batch->gpio && !map_gpio()) {
+		atomic_fetch_add(&batch->failures, 1);
+		cpu_destroy(cpu);
+		return NULL;
+	}
+	if (batch->profile)
+		cpu->profile = profile_create();
+	size_t i;
+	uint64_t run_ns;
+	while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+		if (!emulate_file(cpu, batch->in_files[i], batch->out_files[i], batch->max_instrs,
+						  &run_ns)) {
+			fprintf(stderr, "Failed to emulate %s\n", batch->in_files[i]);
+			atomic_fetch_add(&batch->failures, 1);
+		}
+		atomic_fetch_add(&batch->instructions, cpu_instructions(cpu));
+	}
+	if (cpu->profile) {
+		pthread_mutex_lock(&batch->profile_lock);
+		profile_merge(batch->profile, cpu->profile);
+		pthread_mutex_unlock(&batch->profile_lock);
+		profile_destroy(cpu->profile);
+	}
+	cpu_destroy(cpu);
+	return NULL;
+}
+
+// each line of {list_file} is a bin file, optionally followed by where to write its final state,
+// which defaults to the bin file's name with .out appended
+static bool read_batch(const char *list_file, Batch *batch) {
+	FILE *list = fopen(list_file, "r");
+	if (!list) {
+		perror("Failed to open batch list");
+		return false;
+	}
+	size_t capacity = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, list) != -1) {
+		char *save;
+		char *in_file = strtok_r(line, " \t\r\n", &save);
+		if (!in_file)
+			continue;
+		char *out_file = strtok_r(NULL, " \t\r\n", &save);
+		if (batch->count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			batch->in_files = realloc(batch->in_files, capacity * sizeof(char *));
+			batch->out_files = realloc(batch->out_files, capacity * sizeof(char *));
+			assert(batch->in_files && batch->out_files);
+		}
+		batch->in_files[batch->count] = strdup(in_file);
+		batch->out_files[batch->count] = strdup(out_file ? out_file : in_file);
+		batch->count++;
+	}
+	free(line);
+	fclose(list);
+	return true;
+}
+
+// runs every program in {list_file} on a pool of {jobs} threads, each with its own CpuState.
+// with a {profile}, it ends up with the counts of all programs, summed by pc
+static int run_batch(const char *list_file, unsigned jobs, bool use_jit, bool gpio,
+					 uint64_t max_instrs, bool stats, Profile *profile) {
+	Batch batch = {.use_jit = use_jit, .gpio = gpio, .max_instrs = max_instrs, .profile = profile};
+	pthread_mutex_init(&batch.profile_lock, NULL);
+	if (!read_batch(list_file, &batch))
+		return EXIT_FAILURE;
+	uint64_t start = now_ns();
+	if (jobs == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cores > 0 ? cores : 1;
+	}
+	if (jobs > batch.count)
+		jobs = batch.count;
+
+	pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+	assert(workers || jobs == 0);
+	for (unsigned i = 0; i < jobs; ++i) {
+		if (pthread_create(&workers[i], NULL, batch_worker, &batch) != 0) {
+			fprintf(stderr, "Failed to create batch worker\n");
+			jobs = i;
 			break;
-		decode_and_execute(instr);
+		}
+	}
+	if (jobs == 0) // no worker could be started, so do it all here
+		batch_worker(&batch);
+	for (unsigned i = 0; i < jobs; ++i) {
+		pthread_join(workers[i], NULL);
 	}
+	free(workers);
+	if (stats) // wall time, so this is the throughput of all workers together
+		print_stats(atomic_load(&batch.instructions), now_ns() - start);
 
-	FILE *out = stdout;
+	for (size_t i = 0; i < batch.count; ++i) {
+		free(batch.in_files[i]);
+		free(batch.out_files[i]);
+	}
+	free(batch.in_files);
+	free(batch.out_files);
+	pthread_mutex_destroy(&batch.profile_lock);
+	return atomic_load(&batch.failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// runs {in_file} on {num_cores} cores sharing one memory, core i starting at the i-th address in
+// the comma separated {entry_list}, or at 0 if it has none. {max_instrs} applies to each core
+static int run_smp(char *in_file, const char *out_file, unsigned num_cores, char *entry_list,
+				   bool use_jit, bool gpio, uint64_t max_instrs, bool stats) {
+	uint64_t entries[SMP_MAX_CORES] = {0};
+	unsigned count = 0;
+	char *save;
+	for (char *entry = entry_list ? strtok_r(entry_list, ",", &save) : NULL; entry;
+		 entry = strtok_r(NULL, ",", &save)) {
+		if (count == num_cores) {
+			fprintf(stderr, "More entry points than the %u cores\n", num_cores);
+			return EXIT_FAILURE;
+		}
+		entries[count++] = strtoull(entry, NULL, 0);
+	}
 
-	if (argc == 3) {
-		size_t outLen = strlen(argv[2]);
-		if (outLen >= 4 && !strcmp(argv[2] + outLen - 4, ".out")) {
-			out = fopen(argv[2], "w");
+	Smp *smp = smp_create(num_cores, use_jit);
+	if (use_jit && !smp->cores[0]->use_jit)
+		fprintf(stderr, "JIT not available on this host, interpreting instead\n");
+	cpu_bind(smp->cores[0]); // the cores share its memory, and so the controllers mapped there
+	bool ok = (!gpio || map_gpio()) && smp_load(smp, in_file, entries);
+	if (ok) {
+		uint64_t start = now_ns();
+		if (!smp_run(smp, max_instrs)) {
+			fprintf(stderr, "%s: not every core halted within %" PRIu64 " instructions\n",
+					in_file, max_instrs);
+			ok = false;
+		}
+		uint64_t run_ns = now_ns() - start;
+		FILE *out = open_output(out_file);
+		if (out) {
+			smp_export(smp, out);
+			if (out != stdout)
+				fclose(out);
 		} else {
-			char *new = malloc(outLen + 5);
-			strcpy(new, argv[2]);
-			strcat(new, ".out");
-			out = fopen(new, "w");
-			free(new);
+			ok = false;
 		}
-		if (out == NULL) {
+		if (stats) // all cores together over wall time
+			print_stats(smp_instructions(smp), run_ns);
+	}
+	smp_destroy(smp);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// writes the hot-spot report of {profile} to {file}, or to stderr if it is "-"
+static bool write_profile(const Profile *profile, const char *file) {
+	FILE *out = strcmp(file, "-") ? fopen(file, "w") : stderr;
+	if (!out) {
+		perror("Failed to open profile report");
+		return false;
+	}
+	profile_report(profile, out);
+	if (out != stderr)
+		fclose(out);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	bool use_jit = false;
+	bool gpio = false;
+	bool stats = false;
+	uint64_t max_instrs = CPU_NO_LIMIT;
+	char *batch_list = NULL;
+	char *profile_file = NULL;
+	char *trace_file = NULL;
+	char *snapshot_file = NULL;
+	uint64_t snapshot_at = 0;
+	char *restore_file = NULL;
+	char *diff_file = NULL;
+	unsigned jobs = 0; // one per core
+	unsigned num_cores = 1;
+	char *entry_list = NULL;
+	char *in_file = NULL;
+	char *out_file = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--jit") == 0) {
+			use_jit = true;
+		} else if (strcmp(argv[i], "--gpio") == 0) {
+			gpio = true;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			stats = true;
+		} else if (strcmp(argv[i], "--max-instr") == 0 && i + 1 < argc) {
+			max_instrs = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			profile_file = argv[++i];
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			trace_file = argv[++i];
+		} else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 2 < argc) {
+			snapshot_at = strtoull(argv[++i], NULL, 10);
+			snapshot_file = argv[++i];
+		} else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+			restore_file = argv[++i];
+		} else if (strcmp(argv[i], "--diff-against") == 0 && i + 1 < argc) {
+			diff_file = argv[++i];
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_list = argv[++i];
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			jobs = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+			num_cores = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc) {
+			entry_list = argv[++i];
+		} else if (strncmp(argv[i], "--", 2) == 0) {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
 			return EXIT_FAILURE;
+		} else if (!in_file) {
+			in_file = argv[i];
+		} else {
+			out_file = argv[i];
 		}
 	}
 
-	export_normal_registers(out);
-	export_pc(out);
-	export_pstate(out);
-	export_memory(out);
+	if (batch_list && (trace_file || snapshot_file || restore_file || diff_file)) {
+		fprintf(stderr, "--trace, --snapshot-at, --restore and --diff-against take a single "
+						"program\n");
+		return EXIT_FAILURE;
+	}
+	if (profile_file && trace_file) { // a traced run is stepped without being counted
+		fprintf(stderr, "--profile and --trace cannot be combined\n");
+		return EXIT_FAILURE;
+	}
+	if (num_cores == 0 || num_cores > SMP_MAX_CORES) {
+		fprintf(stderr, "--cores takes 1 to %d cores\n", SMP_MAX_CORES);
+		return EXIT_FAILURE;
+	}
+	if ((num_cores > 1 || entry_list) &&
+		(batch_list || profile_file || trace_file || snapshot_file || restore_file || diff_file)) {
+		fprintf(stderr, "--cores and --entry cannot be combined with --batch, --profile, --trace, "
+						"--snapshot-at, --restore or --diff-against\n");
+		return EXIT_FAILURE;
+	}
+	if (num_cores > 1 || entry_list) {
+		assert(in_file);
+		return run_smp(in_file, out_file, num_cores, entry_list, use_jit, gpio, max_instrs, stats);
+	}
+	if (restore_file) { // there is no bin file, the only file given is the output
+		out_file = in_file;
+		in_file = NULL;
+	}
 
-	if (out != stdout) {
-		fclose(out);
+	if (profile_file && use_jit) {
+		fprintf(stderr, "--profile runs the interpreter, ignoring --jit\n");
+		use_jit = false;
 	}
+	Profile *profile = profile_file ? profile_create() : NULL;
+	int status;
+	if (batch_list) {
+		status = run_batch(batch_list, jobs, use_jit, gpio, max_instrs, stats, profile);
+	} else {
+		assert(in_file || restore_file);
+		CpuState *cpu = cpu_create(use_jit);
+		if (use_jit && !cpu->use_jit)
+			fprintf(stderr, "JIT not available on this host, interpreting instead\n");
+		cpu->profile = profile;
+		if (gpio && !map_gpio()) {
+			cpu_destroy(cpu);
+			profile_destroy(profile);
+			return EXIT_FAILURE;
+		}
+		if (trace_file && !(cpu->trace = trace_open(trace_file))) {
+			perror("Failed to open trace");
+			cpu_destroy(cpu);
+			profile_destroy(profile);
+			return EXIT_FAILURE;
+		}
 
-	registers_destroy();
-	mem_destroy();
+		uint64_t run_ns = 0;
+		uint64_t prefix = 0; // instructions not executed in this run
+		bool loaded;
+		if (restore_file) {
+			loaded = cpu_restore(cpu, restore_file);
+			if (!loaded)
+				fprintf(stderr, "Failed to restore snapshot %s\n", restore_file);
+		} else if (snapshot_file) {
+			loaded = snapshot_prefix(cpu, in_file, snapshot_at, snapshot_file);
+		} else {
+			loaded = cpu_load(cpu, in_file);
+		}
+		prefix = cpu_instructions(cpu);
+		bool ok = loaded && run_program(cpu, restore_file ? restore_file : in_file, max_instrs,
+										&run_ns);
+		// a diff replaces the final state on stdout, but a given output file is still written
+		if (loaded && (out_file || !diff_file))
+			ok = export_state(cpu, out_file) && ok;
+		if (loaded && diff_file)
+			ok = diff_state(cpu, diff_file) && ok;
+		if (stats)
+			print_stats(cpu_instructions(cpu) - prefix, run_ns);
+		if (cpu->trace && !trace_close(cpu->trace)) {
+			fprintf(stderr, "Failed to write trace %s\n", trace_file);
+			ok = false;
+		}
+		cpu_destroy(cpu);
+		status = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-	return EXIT_SUCCESS;
+	if (profile) {
+		if (!write_profile(profile, profile_file))
+			status = EXIT_FAILURE;
+		profile_destroy(profile);
+	}
+	return status;
 }
@@ -1,5 +1,6 @@
 #include "fde.h"
 #include "bit_utils.h"
+#include "block_cache.h"
 #include "emu_memory.h"
 #include "emu_registers.h"
 #include "instructions.h"
@@ -7,233 +8,324 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// threaded dispatch: handlers tail-call the next handler instead of returning to a loop
+#define DISPATCH_NEXT(d) ((d) + 1)->handler((d) + 1)
+
+const char *const instr_class_names[CLASS_COUNT] = {
+	[CLASS_UNKNOWN] = "unknown",
+	[CLASS_HALT] = "halt",
+	[CLASS_DP_IMM_ARITH] = "dp_imm_arith",
+	[CLASS_DP_IMM_WIDE_MOV] = "dp_imm_wide_mov",
+	[CLASS_DP_REG_ARITH] = "dp_reg_arith",
+	[CLASS_DP_REG_LOGIC] = "dp_reg_logic",
+	[CLASS_DP_REG_MUL] = "dp_reg_mul",
+	[CLASS_LDR_UOFFSET] = "ldr_uoffset",
+	[CLASS_STR_UOFFSET] = "str_uoffset",
+	[CLASS_LDR_PREINDEXED] = "ldr_preindexed",
+	[CLASS_STR_PREINDEXED] = "str_preindexed",
+	[CLASS_LDR_POSTINDEXED] = "ldr_postindexed",
+	[CLASS_STR_POSTINDEXED] = "str_postindexed",
+	[CLASS_LDR_REGOFFSET] = "ldr_regoffset",
+	[CLASS_STR_REGOFFSET] = "str_regoffset",
+	[CLASS_LDR_LITERAL] = "ldr_literal",
+	[CLASS_BRANCH] = "b",
+	[CLASS_BRANCH_REG] = "br",
+	[CLASS_BRANCH_COND] = "b_cond",
+	[CLASS_BLOCK_END] = "block_end",
+};
+
 uint32_t fetch() {
 	uint32_t instruction = mem_load32((uint32_t)pc_load());
 	return instruction;
 }
 
-void decode_and_execute(uint32_t instr) {
-	uint32_t op0 = extract_bits(instr, 25, 4);
-
-	switch (op0) {
-	case 0x8: // 1000 - DP (Immediate)
-	case 0x9: // 1001 - DP (Immediate)
-	{
-		// DP (Immediate)
-		uint32_t opi = extract_bits(instr, 23, 3);
-		switch (opi) {
-		case 0x2: // 010 - Arithmetic
-		{
-			bool sh = extract_bits(instr, 22, 1);
-			uint32_t opc = extract_bits(instr, 29, 2);
-			uint64_t rd = extract_bits(instr, 0, 5);
-			uint64_t sf = extract_bits(instr, 31, 1);
-			uint64_t rn = extract_bits(instr, 5, 5);
-			uint64_t imm12 = extract_bits(instr, 10, 12);
-			if (sh)
-				imm12 = (imm12 << 12);
-			if (opc == 0x0)
-				add(rd, rn, imm12, sf);
-			else if (opc == 0x1)
-				adds(rd, rn, imm12, sf);
-			else if (opc == 0x2)
-				sub(rd, rn, imm12, sf);
-			else if (opc == 0x3)
-				subs(rd, rn, imm12, sf);
-			else {
-				printf("ERROR: Unknown opc for Arithmetic instruction\n");
-				return;
-			}
-			break;
-		}
-		case 0x5: // 101 - Wide Mov
-		{
-			uint32_t opc = extract_bits(instr, 29, 2);
-			if (opc == 0x0)
-				execute_movn(instr);
-			else if (opc == 0x2)
-				execute_movz(instr);
-			else if (opc == 0x3)
-				execute_movk(instr);
-			else {
-				printf("ERROR: Unknown opc for Wide Mov instruction.\n");
-				return;
-			}
-			break;
-		}
-		default: {
-			printf("ERROR: Unknown opi for DP Immediate instruction.\n");
-			return;
-		}
-		}
-		pc_jump(1);
-		break;
+// a store may have overwritten later instructions of this block, so stop to have them redecoded
+static inline void dispatch_after_store(const DecodedInstr *d) {
+	if (cur_blocks->dirty)
+		pc_store(d->pc + 4);
+	else
+		DISPATCH_NEXT(d);
+}
+
+// instruction handlers, each executes one decoded instruction and dispatches to the next
+
+static void exec_unknown(const DecodedInstr *d) {
+	printf("ERROR: Unknown instruction.\n");
+	pc_store(d->pc);
+}
+
+static void exec_block_end(const DecodedInstr *d) { pc_store(d->pc); }
+
+static void exec_return(const DecodedInstr *d) {}
+
+static inline void no_flags(uint64_t a, uint64_t b, uint64_t result, bool sf) {}
+
+static inline void logic_flags(uint64_t a, uint64_t b, uint64_t result, bool sf) {
+	flags_from_logic(result, sf);
+}
+
+// data processing handlers come in a W and an X form generated from the templates below. {T} is
+// the register width, so results wrap without being masked, and the decode table picks the form
+// from the sf bit
+#define ALU_HANDLER(name, operand, op, set_flags, w, T, sf)                                        \
+	static void exec_##name##_##w(const DecodedInstr *d) {                                         \
+		T a = register_load_##w(d->rn);                                                            \
+		T b = operand##_##w(d);                                                                    \
+		T result = a op b;                                                                         \
+		register_store_##w(d->rd, result);                                                         \
+		set_flags(a, b, result, sf);                                                               \
+		DISPATCH_NEXT(d);                                                                          \
 	}
 
-	case 0x5: // 0101 - DP (Register)
-	case 0xD: // 1101 - DP (Register)
-	{
-		uint64_t rd = extract_bits(instr, 0, 5);
-		uint64_t rn = extract_bits(instr, 5, 5);
-		uint64_t rm = extract_bits(instr, 16, 5);
-		uint64_t sf = extract_bits(instr, 31, 1);
-		uint64_t opc = extract_bits(instr, 29, 2);
-		uint64_t operand = extract_bits(instr, 10, 6);
-		uint32_t opr = extract_bits(instr, 21, 4);
-		uint32_t M = extract_bits(instr, 28, 1);
-
-		if (M == 0x0 && (opr & 0x9) == 0x8) {
-			// Arithmetic
-			uint32_t shift = extract_bits(instr, 22, 2);
-			// uint32_t is_arithmetic = extract_bits(instr, 24, 1);
-			uint64_t amount = operand;
-			uint64_t rmv = register_load(rm, sf);
-			rmv = shift == 0   ? logical_shift_left(rmv, amount, get_width(sf))
-				  : shift == 1 ? logical_shift_right(rmv, amount, get_width(sf))
-				  : shift == 2 ? arithmetic_shift_right(rmv, amount, get_width(sf))
-							   : rmv;
-			switch (opc) {
-			case 0:
-				add(rd, rn, rmv, sf);
-				break;
-			case 1:
-				adds(rd, rn, rmv, sf);
-				break;
-			case 2:
-				sub(rd, rn, rmv, sf);
-				break;
-			case 3:
-				subs(rd, rn, rmv, sf);
-				break;
-			default:
-				printf("ERROR: Unknown opc in Arithmetic.\n");
-				return;
-			}
-
-		} else if (M == 0x0 && (opr & 0x8) == 0x0) {
-			uint64_t shift = extract_bits(instr, 22, 2);
-			uint64_t amount = operand;
-			bool nflag = opr & 0x1;
-			uint64_t rmv = register_load(rm, sf);
-			uint64_t base = shift == 0	 ? logical_shift_left(rmv, amount, get_width(sf))
-							: shift == 1 ? logical_shift_right(rmv, amount, get_width(sf))
-							: shift == 2 ? arithmetic_shift_right(rmv, amount, get_width(sf))
-										 : rotate_right(rmv, amount, get_width(sf));
-			uint64_t op2 = nflag ? (~base & make_mask(0, get_width(sf))) : base;
-			switch (opc) {
-			case 0:
-				execute_and(rd, rn, op2, sf);
-				break; // AND or BIC
-			case 1:
-				execute_orr(rd, rn, op2, sf);
-				break; // ORR or ORN
-			case 2:
-				execute_eor(rd, rn, op2, sf);
-				break; // EOR or EON
-			case 3:
-				execute_ands(rd, rn, op2, sf);
-				break; // ANDS or BICS
-			default:
-				printf("ERROR: Unknown opc in Logical.\n");
-				return;
-			}
-		}
+// madd and msub, ra op rn * rm
+#define MUL_HANDLER(name, op, w, T)                                                                \
+	static void exec_##name##_##w(const DecodedInstr *d) {                                         \
+		T product = register_load_##w(d->rn) * register_load_##w(d->rm);                           \
+		T result = register_load_##w(d->ra) op product;                                            \
+		register_store_##w(d->rd, result);                                                         \
+		DISPATCH_NEXT(d);                                                                          \
+	}
 
-		else if (M == 0x1 && opr == 0x8) {
-			// Multiply
-			uint64_t ra = extract_bits(operand, 0, 5);
-			uint64_t sub = extract_bits(operand, 5, 1);
-			if (sub == 0)
-				madd(rd, rn, rm, ra, sf);
-			else
-				msub(rd, rn, rm, ra, sf);
-		} else {
-			printf("ERROR: Unknown DP Register instruction.\n");
-			return;
-		}
-		pc_jump(1);
-		break;
+// every data processing handler of one form. movn and movz have their result fully determined at
+// decode time, so they share exec_mov_const
+#define DP_HANDLERS(w, T, sf)                                                                      \
+	static inline T imm_operand_##w(const DecodedInstr *d) { return d->imm; }                      \
+	static inline T reg_operand_##w(const DecodedInstr *d) {                                       \
+		return apply_shift(register_load_##w(d->rm), d->shift, d->amount, sf);                     \
+	}                                                                                              \
+	static inline T logic_operand_##w(const DecodedInstr *d) {                                     \
+		return reg_operand_##w(d) ^ (T)d->inv_mask;                                                \
+	}                                                                                              \
+	ALU_HANDLER(add_imm, imm_operand, +, no_flags, w, T, sf)                                       \
+	ALU_HANDLER(adds_imm, imm_operand, +, flags_from_add, w, T, sf)                                \
+	ALU_HANDLER(sub_imm, imm_operand, -, no_flags, w, T, sf)                                       \
+	ALU_HANDLER(subs_imm, imm_operand, -, flags_from_sub, w, T, sf)                                \
+	ALU_HANDLER(add_reg, reg_operand, +, no_flags, w, T, sf)                                       \
+	ALU_HANDLER(adds_reg, reg_operand, +, flags_from_add, w, T, sf)                                \
+	ALU_HANDLER(sub_reg, reg_operand, -, no_flags, w, T, sf)                                       \
+	ALU_HANDLER(subs_reg, reg_operand, -, flags_from_sub, w, T, sf)                                \
+	ALU_HANDLER(and_reg, logic_operand, &, no_flags, w, T, sf)                                     \
+	ALU_HANDLER(orr_reg, logic_operand, |, no_flags, w, T, sf)                                     \
+	ALU_HANDLER(eor_reg, logic_operand, ^, no_flags, w, T, sf)                                     \
+	ALU_HANDLER(ands_reg, logic_operand, &, logic_flags, w, T, sf)                                 \
+	MUL_HANDLER(madd, +, w, T)                                                                     \
+	MUL_HANDLER(msub, -, w, T)                                                                     \
+	static void exec_mov_const_##w(const DecodedInstr *d) {                                        \
+		register_store_##w(d->rd, d->imm);                                                         \
+		DISPATCH_NEXT(d);                                                                          \
+	}                                                                                              \
+	static void exec_movk_##w(const DecodedInstr *d) {                                             \
+		T orig = register_load_##w(d->rd);                                                         \
+		register_store_##w(d->rd, (orig & ~(0xFFFFULL << d->amount)) | d->imm);                    \
+		DISPATCH_NEXT(d);                                                                          \
 	}
 
-	case 0x4: // 0100 - Load/Store
-	case 0x6: // 0110 - Load/Store
-	case 0xC: // 1100 - Load/Store
-	case 0xE: // 1110 - Load/Store
-	{
-		uint64_t rt = extract_bits(instr, 0, 5);
-		uint64_t sf = extract_bits(instr, 30, 1);
-		uint64_t M = extract_bits(instr, 31, 1);
-		if (M) {
-			uint64_t xn = extract_bits(instr, 5, 5);
-			uint64_t L = extract_bits(instr, 22, 1);
-			uint64_t U = extract_bits(instr, 24, 1);
-			if (U) {
-				uint64_t imm12 = extract_bits(instr, 10, 12);
-				if (L)
-					ldr_uoffset(rt, xn, imm12, sf);
-				else
-					str_uoffset(rt, xn, imm12, sf);
-			} else {
-				uint64_t offsetM = extract_bits(instr, 21, 1);
-				if (offsetM) {
-					uint64_t xm = extract_bits(instr, 16, 5);
-					if (L)
-						ldr_regoffset(rt, xn, xm, sf);
-					else
-						str_regoffset(rt, xn, xm, sf);
-				} else {
-					uint64_t simm9 = extract_bits(instr, 12, 9);
-					uint64_t I = extract_bits(instr, 11, 1);
-					if (I) {
-						if (L)
-							ldr_preindexed(rt, xn, simm9, sf);
-						else
-							str_preindexed(rt, xn, simm9, sf);
-					} else {
-						if (L)
-							ldr_postindexed(rt, xn, simm9, sf);
-						else
-							str_postindexed(rt, xn, simm9, sf);
-					}
-				}
-			}
-		} else {
-			uint64_t simm19 = extract_bits(instr, 5, 19);
-			ldr_literal(rt, simm19, sf);
-		}
-		pc_jump(1);
-		break;
+DP_HANDLERS(w, uint32_t, false)
+DP_HANDLERS(x, uint64_t, true)
+
+// effective address of each addressing mode for a {size} byte access, base register writeback
+// included, so it has to be computed before a store reads its source register
+static inline uint32_t uoffset_address(const DecodedInstr *d, unsigned size) {
+	return (uint32_t)register_load_x(d->rn) + d->imm * size;
+}
+
+static inline uint32_t pre_address(const DecodedInstr *d, unsigned size) {
+	uint32_t address = (uint32_t)(register_load_x(d->rn) + sign_extend(d->imm, 9));
+	register_store_x(d->rn, address);
+	return address;
+}
+
+static inline uint32_t post_address(const DecodedInstr *d, unsigned size) {
+	uint64_t base = register_load_x(d->rn);
+	register_store_x(d->rn, base + sign_extend(d->imm, 9));
+	return (uint32_t)base;
+}
+
+static inline uint32_t regoffset_address(const DecodedInstr *d, unsigned size) {
+	return (uint32_t)(register_load_x(d->rn) + register_load_x(d->rm));
+}
+
+// the decode table picks the X or W variant of a load or store from its sf bit, so neither
+// the access nor the register write tests it again
+#define LOAD_STORE_HANDLERS(mode)                                                                  \
+	static void exec_ldr_##mode##_x(const DecodedInstr *d) {                                       \
+		uint32_t address = mode##_address(d, 8);                                                   \
+		register_store_x(d->rd, mem_load64(address));                                              \
+		DISPATCH_NEXT(d);                                                                          \
+	}                                                                                              \
+	static void exec_ldr_##mode##_w(const DecodedInstr *d) {                                       \
+		uint32_t address = mode##_address(d, 4);                                                   \
+		register_store_w(d->rd, mem_load32(address));                                              \
+		DISPATCH_NEXT(d);                                                                          \
+	}                                                                                              \
+	static void exec_str_##mode##_x(const DecodedInstr *d) {                                       \
+		uint32_t address = mode##_address(d, 8);                                                   \
+		mem_store64(address, register_load_x(d->rd));                                              \
+		dispatch_after_store(d);                                                                   \
+	}                                                                                              \
+	static void exec_str_##mode##_w(const DecodedInstr *d) {                                       \
+		uint32_t address = mode##_address(d, 4);                                                   \
+		mem_store32(address, (uint32_t)register_load_w(d->rd));                                    \
+		dispatch_after_store(d);                                                                   \
 	}
-	case 0xA: // 1010 - Branch
-	case 0xB: // 1011 - Branch
-	{		  // Branch
-		uint64_t branch_type = extract_bits(instr, 29, 3);
-		if (branch_type == 0x0) {
-			// Unconditional Branch
-			uint64_t simm26 = extract_bits(instr, 0, 26);
-			simm26 = sign_extend(simm26, 26);
-			pc_jump(simm26);
-			break;
-
-		} else if (branch_type == 0x6) {
-			// Register Branch
-			uint64_t xn = extract_bits(instr, 5, 5);
-			pc_jump_indirect(xn);
-			break;
 
+LOAD_STORE_HANDLERS(uoffset)
+LOAD_STORE_HANDLERS(pre)
+LOAD_STORE_HANDLERS(post)
+LOAD_STORE_HANDLERS(regoffset)
+
+// literal address was resolved against the instruction's pc at decode time
+static void exec_ldr_literal_x(const DecodedInstr *d) {
+	register_store_x(d->rd, mem_load64(d->imm));
+	DISPATCH_NEXT(d);
+}
+
+static void exec_ldr_literal_w(const DecodedInstr *d) {
+	register_store_w(d->rd, mem_load32(d->imm));
+	DISPATCH_NEXT(d);
+}
+
+static void exec_b(const DecodedInstr *d) { pc_store(d->imm); }
+
+static void exec_br(const DecodedInstr *d) { pc_jump_indirect(d->rn); }
+
+static void exec_b_cond(const DecodedInstr *d) {
+	pc_store(check_condition(d->shift) ? d->imm : (uint64_t)d->pc + 4);
+}
+
+// how the fields of an instruction are laid out, named by decode.def
+typedef enum {
+	FMT_UNKNOWN,
+	FMT_ARITH_IMM,
+	FMT_WIDE_MOV,
+	FMT_WIDE_MOVN,
+	FMT_ARITH_REG,
+	FMT_LOGIC_REG,
+	FMT_MUL,
+	FMT_LITERAL,
+	FMT_UOFFSET,
+	FMT_REGOFFSET,
+	FMT_INDEXED,
+	FMT_BRANCH,
+	FMT_BRANCH_REG,
+	FMT_BRANCH_COND,
+} DecodeFormat;
+
+// what an instruction decodes to. formats telling two instructions apart by a bit outside the
+// table index use the alt_ ones when that bit is clear
+typedef struct {
+	uint8_t format;
+	uint8_t cls;
+	InstrHandler handler;
+	uint8_t alt_cls;
+	InstrHandler alt_handler;
+} DecodeRule;
+
+#include "decode_table.h"
+
+// field of {instr}, inlined rather than calling extract_bits() for each one
+#define FIELD(instr, lsb, width) (((instr) >> (lsb)) & ((1u << (width)) - 1))
+
+static inline void use_alt(const DecodeRule *rule, DecodedInstr *d) {
+	d->cls = rule->alt_cls;
+	d->handler = rule->alt_handler;
+}
+
+// decodes {instr} at {pc} once into {d}, which can then be executed any number of times.
+// instruction bits 31..21 select the rule from the generated table, its format then says
+// which fields to extract. branch targets are resolved against {pc} here
+void decode(uint32_t instr, uint64_t pc, DecodedInstr *d) {
+	const DecodeRule *rule = &decode_rules[decode_index[instr >> 21]];
+	*d = (DecodedInstr){.handler = rule->handler, .raw = instr, .pc = pc, .cls = rule->cls};
+
+	switch (rule->format) {
+	case FMT_ARITH_IMM:
+		d->rd = FIELD(instr, 0, 5);
+		d->rn = FIELD(instr, 5, 5);
+		d->sf = FIELD(instr, 31, 1);
+		d->imm = (uint64_t)FIELD(instr, 10, 12) << (FIELD(instr, 22, 1) * 12);
+		break;
+	case FMT_WIDE_MOV:
+	case FMT_WIDE_MOVN:
+		d->rd = FIELD(instr, 0, 5);
+		d->sf = FIELD(instr, 31, 1);
+		d->amount = FIELD(instr, 21, 2) * 16;
+		d->imm = (uint64_t)FIELD(instr, 5, 16) << d->amount;
+		if (rule->format == FMT_WIDE_MOVN)
+			d->imm = ~d->imm & (d->sf ? UINT64_MAX : UINT32_MAX);
+		break;
+	case FMT_ARITH_REG:
+	case FMT_LOGIC_REG:
+	case FMT_MUL:
+		d->rd = FIELD(instr, 0, 5);
+		d->rn = FIELD(instr, 5, 5);
+		d->rm = FIELD(instr, 16, 5);
+		d->sf = FIELD(instr, 31, 1);
+		d->shift = FIELD(instr, 22, 2);
+		d->amount = FIELD(instr, 10, 6);
+		if (rule->format == FMT_ARITH_REG && d->shift == 3) { // reserved, operand used unshifted
+			d->shift = 0;
+			d->amount = 0;
+		} else if (rule->format == FMT_LOGIC_REG) {
+			d->inv_mask = FIELD(instr, 21, 1) ? (d->sf ? UINT64_MAX : UINT32_MAX) : 0;
+			if (IS_HALT(instr))
+				d->cls = CLASS_HALT;
+		} else if (rule->format == FMT_MUL) {
+			d->ra = FIELD(instr, 10, 5);
+			if (!FIELD(instr, 15, 1)) // madd
+				use_alt(rule, d);
+		}
+		break;
+	case FMT_LITERAL:
+		d->rd = FIELD(instr, 0, 5);
+		d->sf = FIELD(instr, 30, 1);
+		d->imm = (uint32_t)(pc + sign_extend(FIELD(instr, 5, 19) * 4, 21));
+		break;
+	case FMT_UOFFSET:
+	case FMT_REGOFFSET:
+	case FMT_INDEXED:
+		d->rd = FIELD(instr, 0, 5);
+		d->rn = FIELD(instr, 5, 5);
+		d->sf = FIELD(instr, 30, 1);
+		if (rule->format == FMT_UOFFSET) {
+			d->imm = FIELD(instr, 10, 12);
+		} else if (rule->format == FMT_REGOFFSET) {
+			d->rm = FIELD(instr, 16, 5);
 		} else {
-			// Conditional Branch
-			uint64_t simm19 = extract_bits(instr, 5, 19);
-			simm19 = sign_extend(simm19, 19);
-			uint64_t cond = extract_bits(instr, 0, 4);
-			pc_jump_conditional(simm19, cond);
-			break;
+			d->imm = FIELD(instr, 12, 9);
+			if (!FIELD(instr, 11, 1)) // post-indexed
+				use_alt(rule, d);
 		}
 		break;
-	}
+	case FMT_BRANCH:
+		d->imm = pc + (sign_extend(FIELD(instr, 0, 26), 26) << 2);
+		break;
+	case FMT_BRANCH_REG:
+		d->rn = FIELD(instr, 5, 5);
+		break;
+	case FMT_BRANCH_COND:
+		d->imm = pc + (sign_extend(FIELD(instr, 5, 19), 19) << 2);
+		d->shift = FIELD(instr, 0, 4);
+		break;
 	default:
-		// Unknown
-		printf("ERROR: Unknown instruction.\n");
 		break;
 	}
 }
+
+// terminates a run of decoded instructions that does not end with a branch
+void decode_block_end(uint64_t pc, DecodedInstr *d) {
+	*d = (DecodedInstr){.handler = exec_block_end, .pc = pc, .cls = CLASS_BLOCK_END};
+}
+
+// terminates a single instruction whose handler is called on its own, returning to the caller
+// without touching pc
+void decode_return(DecodedInstr *d) {
+	*d = (DecodedInstr){.handler = exec_return, .cls = CLASS_BLOCK_END};
+}
+
+void decode_and_execute(uint32_t instr) {
+	DecodedInstr d[2];
+	decode(instr, pc_load(), &d[0]);
+	decode_block_end(pc_load() + 4, &d[1]);
+	d[0].handler(&d[0]);
+}
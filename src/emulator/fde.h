@@ -1,9 +1,67 @@
 #ifndef FDE_H
 #define FDE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define IS_HALT(instruction) ((instruction) == 0x8a000000)
+// classes whose handlers set pc themselves rather than dispatching to the next instruction
+#define ENDS_BLOCK(cls)                                                                            \
+	((cls) == CLASS_UNKNOWN || (cls) == CLASS_BRANCH || (cls) == CLASS_BRANCH_REG ||               \
+	 (cls) == CLASS_BRANCH_COND || (cls) == CLASS_BLOCK_END)
+
+typedef enum {
+	CLASS_UNKNOWN,
+	CLASS_HALT,
+	CLASS_DP_IMM_ARITH,
+	CLASS_DP_IMM_WIDE_MOV,
+	CLASS_DP_REG_ARITH,
+	CLASS_DP_REG_LOGIC,
+	CLASS_DP_REG_MUL,
+	CLASS_LDR_UOFFSET,
+	CLASS_STR_UOFFSET,
+	CLASS_LDR_PREINDEXED,
+	CLASS_STR_PREINDEXED,
+	CLASS_LDR_POSTINDEXED,
+	CLASS_STR_POSTINDEXED,
+	CLASS_LDR_REGOFFSET,
+	CLASS_STR_REGOFFSET,
+	CLASS_LDR_LITERAL,
+	CLASS_BRANCH,
+	CLASS_BRANCH_REG,
+	CLASS_BRANCH_COND,
+	CLASS_BLOCK_END, // not an instruction, sets pc after a block that ends without a branch
+	CLASS_COUNT
+} InstrClass;
+
+extern const char *const instr_class_names[CLASS_COUNT];
+
+typedef struct DecodedInstr DecodedInstr;
+typedef void (*InstrHandler)(const DecodedInstr *d);
+
+// instruction with all fields pre-extracted, so executing it needs no further decoding.
+// decoded instructions are laid out in arrays, and each handler calls the next one's directly
+// until it reaches one of a class that ENDS_BLOCK.
+struct DecodedInstr {
+	InstrHandler handler;
+	uint64_t imm;	   // immediate, offset, address or branch target, depending on class
+	uint64_t inv_mask; // xored into op2 of logical instructions (BIC, ORN, EON, BICS)
+	uint32_t raw;
+	uint32_t pc;
+	uint8_t cls;
+	uint8_t rd; // also rt for loads/stores
+	uint8_t rn; // also xn for loads/stores
+	uint8_t rm; // also xm for loads/stores
+	uint8_t ra;
+	uint8_t sf;
+	uint8_t shift;	// shift type, or cond for conditional branches
+	uint8_t amount; // shift amount
+};
+
 uint32_t fetch();
+void decode(uint32_t instr, uint64_t pc, DecodedInstr *d);
+void decode_block_end(uint64_t pc, DecodedInstr *d);
+void decode_return(DecodedInstr *d);
 void decode_and_execute(uint32_t instr);
 
 #endif
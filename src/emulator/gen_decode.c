@@ -0,0 +1,108 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// turns the instruction descriptions in decode.def into decode_table.h, a rule for every
+// instruction and a table from instruction bits 31..21 to the rule decoding it
+
+#define INDEX_BITS 11
+#define MAX_RULES 255 // rule numbers are stored in a byte, 0 is an unknown instruction
+#define MAX_NAME 64
+
+typedef struct {
+	unsigned mask;	// index bits the pattern fixes
+	unsigned value; // what they have to be
+	char format[MAX_NAME], cls[MAX_NAME], handler[MAX_NAME];
+	char alt_cls[MAX_NAME], alt_handler[MAX_NAME];
+	int line;
+} Rule;
+
+// reads {pattern} of 0, 1 and x for bits 31..21 into {rule}, false if it is malformed
+static bool parse_pattern(const char *pattern, Rule *rule) {
+	if (strlen(pattern) != INDEX_BITS)
+		return false;
+	rule->mask = rule->value = 0;
+	for (int i = 0; i < INDEX_BITS; ++i) {
+		unsigned bit = 1u << (INDEX_BITS - 1 - i);
+		if (pattern[i] == '0' || pattern[i] == '1') {
+			rule->mask |= bit;
+			rule->value |= pattern[i] == '1' ? bit : 0;
+		} else if (pattern[i] != 'x') {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <decode.def> <decode_table.h>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	FILE *in = fopen(argv[1], "r");
+	if (!in) {
+		perror("Failed to open instruction descriptions");
+		return EXIT_FAILURE;
+	}
+
+	static Rule rules[MAX_RULES + 1];
+	int num_rules = 1;
+	char line[256];
+	for (int line_no = 1; fgets(line, sizeof(line), in); ++line_no) {
+		char pattern[MAX_NAME];
+		Rule *rule = &rules[num_rules];
+		*rule = (Rule){.line = line_no};
+		int fields = sscanf(line, "%63s %63s %63s %63s %63s %63s", pattern, rule->format,
+							rule->cls, rule->handler, rule->alt_cls, rule->alt_handler);
+		if (fields <= 0 || pattern[0] == '#')
+			continue;
+		if ((fields != 4 && fields != 6) || !parse_pattern(pattern, rule)) {
+			fprintf(stderr, "%s:%d: expected a pattern of %d bits, a format, a class and a "
+							"handler, optionally followed by another class and handler\n",
+					argv[1], line_no, INDEX_BITS);
+			fclose(in);
+			return EXIT_FAILURE;
+		}
+		if (++num_rules > MAX_RULES) {
+			fprintf(stderr, "%s:%d: too many instructions\n", argv[1], line_no);
+			fclose(in);
+			return EXIT_FAILURE;
+		}
+	}
+	fclose(in);
+
+	FILE *out = fopen(argv[2], "w");
+	if (!out) {
+		perror("Failed to create decode table");
+		return EXIT_FAILURE;
+	}
+	fprintf(out, "// generated from %s by gen_decode, edit that instead\n\n", argv[1]);
+	fprintf(out, "static const DecodeRule decode_rules[] = {\n");
+	fprintf(out, "\t{FMT_UNKNOWN, CLASS_UNKNOWN, exec_unknown, CLASS_UNKNOWN, exec_unknown},\n");
+	for (int i = 1; i < num_rules; ++i) {
+		const Rule *rule = &rules[i];
+		bool alt = rule->alt_cls[0];
+		fprintf(out, "\t{FMT_%s, CLASS_%s, %s, CLASS_%s, %s}, // line %d\n", rule->format,
+				rule->cls, rule->handler, alt ? rule->alt_cls : rule->cls,
+				alt ? rule->alt_handler : rule->handler, rule->line);
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "// rule for each value of instruction bits 31..21\n");
+	fprintf(out, "static const uint8_t decode_index[1 << %d] = {", INDEX_BITS);
+	for (unsigned index = 0; index < 1u << INDEX_BITS; ++index) {
+		int match = 0;
+		for (int i = 1; i < num_rules && !match; ++i) {
+			if ((index & rules[i].mask) == rules[i].value)
+				match = i;
+		}
+		fprintf(out, "%s%d,", index % 16 ? " " : "\n\t", match);
+	}
+	fprintf(out, "\n};\n");
+	if (fclose(out) != 0) {
+		perror("Failed to write decode table");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+#include "gpio_device.h"
+#include "bit_utils.h"
+#include "emu_memory.h"
+#include "pigpio_emu.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// GPIO controller registers, as offsets into its region
+#define GPFSEL0 0x00 // 3 mode bits for each of 10 pins, 6 of them
+#define GPFSEL5 0x14
+#define GPSET0 0x1C // 1 bits drive their pin high, 2 of them
+#define GPCLR0 0x28 // 1 bits drive their pin low, 2 of them
+#define GPLEV0 0x34 // current pin levels, 2 of them
+#define GPPUD 0x94	// pull-up/down applied to the pins clocked through GPPUDCLK
+#define GPPUDCLK0 0x98
+
+// BSC (I2C controller) registers, as offsets into its region
+#define BSC_C 0x00
+#define BSC_S 0x04
+#define BSC_A 0x0C
+#define BSC_FIFO 0x10
+#define BSC_S_DONE (1 << 1)
+#define BSC_S_TXD (1 << 4)
+#define BSC_S_TXE (1 << 6)
+
+// there is one board, so every machine mapping the controllers shares them, cores of an SMP
+// machine included, hence the locks
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t fsel[6];
+	uint64_t levels; // bit per pin
+	uint32_t pud;
+} GpioController;
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t control;
+	uint32_t addr;
+	uint32_t open_addr;
+	int handle; // of open_addr, -1 before the first byte is sent
+} I2cController;
+
+static GpioController gpio = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static I2cController i2c = {.lock = PTHREAD_MUTEX_INITIALIZER, .handle = -1};
+static pthread_once_t initialised = PTHREAD_ONCE_INIT;
+
+static void initialise(void) { gpioInitialise(); }
+
+// modes of the 10 pins of GPFSEL register {bank}, only changes are passed on
+static void set_modes(GpioController *c, unsigned bank, uint32_t value) {
+	for (unsigned i = 0; i < 10 && bank * 10 + i < GPIO_NUM_PINS; ++i) {
+		uint32_t mode = extract_bits(value, 3 * i, 3);
+		if (mode != extract_bits(c->fsel[bank], 3 * i, 3))
+			gpioSetMode(bank * 10 + i, mode);
+	}
+	c->fsel[bank] = value;
+}
+
+// drives the pins from {first} on whose bit is set in {bits} to {level}
+static void set_levels(GpioController *c, unsigned first, uint32_t bits, unsigned level) {
+	for (; bits; bits &= bits - 1) {
+		unsigned pin = first + ctz(bits);
+		if (pin >= GPIO_NUM_PINS)
+			break;
+		c->levels = level ? set_bit(c->levels, pin) : clear_bit(c->levels, pin);
+		gpioWrite(pin, level);
+	}
+}
+
+static void set_pulls(GpioController *c, unsigned first, uint32_t bits) {
+	for (; bits; bits &= bits - 1) {
+		unsigned pin = first + ctz(bits);
+		if (pin >= GPIO_NUM_PINS)
+			break;
+		gpioSetPullUpDown(pin, c->pud);
+	}
+}
+
+static uint32_t gpio_load_reg(GpioController *c, uint32_t reg) {
+	if (reg <= GPFSEL5)
+		return c->fsel[reg / 4];
+	switch (reg) {
+	case GPLEV0:
+		return (uint32_t)c->levels;
+	case GPLEV0 + 4:
+		return c->levels >> 32;
+	case GPPUD:
+		return c->pud;
+	default: // set and clear registers are write-only, event detection is not modelled
+		return 0;
+	}
+}
+
+static void gpio_store_reg(GpioController *c, uint32_t reg, uint32_t value) {
+	if (reg <= GPFSEL5) {
+		set_modes(c, reg / 4, value);
+		return;
+	}
+	switch (reg) {
+	case GPSET0:
+	case GPSET0 + 4:
+		set_levels(c, (reg - GPSET0) * 8, value, 1);
+		break;
+	case GPCLR0:
+	case GPCLR0 + 4:
+		set_levels(c, (reg - GPCLR0) * 8, value, 0);
+		break;
+	case GPPUD:
+		c->pud = value & 3;
+		break;
+	case GPPUDCLK0:
+	case GPPUDCLK0 + 4:
+		set_pulls(c, (reg - GPPUDCLK0) * 8, value);
+		break;
+	default:
+		break;
+	}
+}
+
+// bytes written to the FIFO go straight out to the addressed device, so transfers are always done
+static uint32_t i2c_load_reg(I2cController *c, uint32_t reg) {
+	switch (reg) {
+	case BSC_C:
+		return c->control;
+	case BSC_S:
+		return BSC_S_DONE | BSC_S_TXD | BSC_S_TXE;
+	case BSC_A:
+		return c->addr;
+	default:
+		return 0;
+	}
+}
+
+static void i2c_store_reg(I2cController *c, uint32_t reg, uint32_t value) {
+	switch (reg) {
+	case BSC_C:
+		c->control = value;
+		break;
+	case BSC_A:
+		c->addr = value & 0x7F;
+		break;
+	case BSC_FIFO:
+		if (c->handle < 0 || c->open_addr != c->addr) {
+			if (c->handle >= 0)
+				i2cClose(c->handle);
+			c->handle = i2cOpen(I2C_BUS, c->addr, 0);
+			c->open_addr = c->addr;
+		}
+		i2cWriteByte(c->handle, value & 0xFF);
+		break;
+	default:
+		break;
+	}
+}
+
+// both controllers have 32-bit registers, a 64-bit access covers two of them
+static uint64_t gpio_load(void *device, uint32_t offset, size_t size) {
+	GpioController *c = device;
+	pthread_mutex_lock(&c->lock);
+	uint64_t value = gpio_load_reg(c, offset & ~3u);
+	if (size == 8)
+		value |= (uint64_t)gpio_load_reg(c, (offset & ~3u) + 4) << 32;
+	pthread_mutex_unlock(&c->lock);
+	return value;
+}
+
+static void gpio_store(void *device, uint32_t offset, uint64_t value, size_t size) {
+	GpioController *c = device;
+	pthread_mutex_lock(&c->lock);
+	gpio_store_reg(c, offset & ~3u, (uint32_t)value);
+	if (size == 8)
+		gpio_store_reg(c, (offset & ~3u) + 4, value >> 32);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static uint64_t i2c_load(void *device, uint32_t offset, size_t size) {
+	I2cController *c = device;
+	pthread_mutex_lock(&c->lock);
+	uint64_t value = i2c_load_reg(c, offset & ~3u);
+	if (size == 8)
+		value |= (uint64_t)i2c_load_reg(c, (offset & ~3u) + 4) << 32;
+	pthread_mutex_unlock(&c->lock);
+	return value;
+}
+
+static void i2c_store(void *device, uint32_t offset, uint64_t value, size_t size) {
+	I2cController *c = device;
+	pthread_mutex_lock(&c->lock);
+	i2c_store_reg(c, offset & ~3u, (uint32_t)value);
+	if (size == 8)
+		i2c_store_reg(c, (offset & ~3u) + 4, value >> 32);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// maps the GPIO and I2C controllers into cur_memory, backed by pigpio_emu, which stands in for
+// the cocktail maker's pumps, buttons and LCD. false if there was no room for them
+bool gpio_device_map(void) {
+	pthread_once(&initialised, initialise);
+	return mem_map_mmio(GPIO_MMIO_BASE, GPIO_MMIO_SIZE, gpio_load, gpio_store, &gpio) &&
+		   mem_map_mmio(I2C_MMIO_BASE, I2C_MMIO_SIZE, i2c_load, i2c_store, &i2c);
+}
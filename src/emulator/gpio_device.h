@@ -0,0 +1,18 @@
+#ifndef GPIO_DEVICE_H
+#define GPIO_DEVICE_H
+
+#include <stdbool.h>
+
+// where the BCM2837 of the Pi 3 has its GPIO controller and BSC1, the I2C controller on the
+// header pins, so firmware for the cocktail maker can run unchanged
+#define GPIO_MMIO_BASE 0x3F200000
+#define GPIO_MMIO_SIZE 0xB4
+#define I2C_MMIO_BASE 0x3F804000
+#define I2C_MMIO_SIZE 0x20
+
+#define GPIO_NUM_PINS 54
+#define I2C_BUS 1
+
+bool gpio_device_map(void);
+
+#endif
@@ -0,0 +1,391 @@
+#include "jit.h"
+#include "bit_utils.h"
+#include "block_cache.h"
+#include "emu_memory.h"
+#include "emu_registers.h"
+#include "fde.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static JitState default_jit;
+_Thread_local JitState *cur_jit = &default_jit;
+
+#if defined(__x86_64__)
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Compiles blocks to x86-64. Guest registers stay in the register file, which is pinned in rbx
+// for the whole block, and every instruction loads its operands from and stores its result back
+// to it. Arithmetic, logical, move, multiply and branch instructions are emitted inline, while
+// flag-setting instructions and memory accesses call the interpreter's own handler on a copy of
+// the instruction, so both run the same code for them.
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RDI 7
+
+#define REX_W 0x48
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+
+#define MAX_INSTR_BYTES 80 // longest sequence emitted for a single instruction
+#define PROLOGUE_BYTES 4
+
+static _Thread_local uint8_t *code = NULL; // where the next byte is emitted
+
+static void emit8(uint8_t byte) { *code++ = byte; }
+
+static void emit32(uint32_t value) {
+	memcpy(code, &value, sizeof(value));
+	code += sizeof(value);
+}
+
+static void emit64(uint64_t value) {
+	memcpy(code, &value, sizeof(value));
+	code += sizeof(value);
+}
+
+// 64-bit operand size, otherwise 32-bit operations zero the upper half like W registers need
+static void emit_rex(bool sf) {
+	if (sf)
+		emit8(REX_W);
+}
+
+static void emit_mov_imm(unsigned host, uint64_t imm) {
+	if (imm > UINT32_MAX)
+		emit8(REX_W);
+	emit8(0xB8 + host);
+	if (imm > UINT32_MAX)
+		emit64(imm);
+	else
+		emit32(imm);
+}
+
+// host := guest register {reg}
+static void emit_load_reg(unsigned host, unsigned reg, bool sf) {
+	if (reg == NUM_REGISTERS) { // xor host, host
+		emit8(0x31);
+		emit8(0xC0 | host << 3 | host);
+		return;
+	}
+	emit_rex(sf);
+	emit8(0x8B);
+	emit8(0x80 | host << 3 | RBX);
+	emit32(reg * sizeof(uint64_t));
+}
+
+// guest register {reg} := host, which is already zero-extended after a 32-bit operation
+static void emit_store_reg(unsigned reg, unsigned host) {
+	if (reg == NUM_REGISTERS)
+		return;
+	emit8(REX_W);
+	emit8(0x89);
+	emit8(0x80 | host << 3 | RBX);
+	emit32(reg * sizeof(uint64_t));
+}
+
+// dst := dst op src
+static void emit_alu(uint8_t op, unsigned dst, unsigned src, bool sf) {
+	emit_rex(sf);
+	emit8(op);
+	emit8(0xC0 | src << 3 | dst);
+}
+
+static void emit_imul(unsigned dst, unsigned src, bool sf) {
+	emit_rex(sf);
+	emit8(0x0F);
+	emit8(0xAF);
+	emit8(0xC0 | dst << 3 | src);
+}
+
+static void emit_not(unsigned host, bool sf) {
+	emit_rex(sf);
+	emit8(0xF7);
+	emit8(0xD0 | host);
+}
+
+// shift types are in A64 order: LSL, LSR, ASR, ROR
+static void emit_shift(unsigned host, unsigned type, unsigned amount, bool sf) {
+	static const uint8_t ext[] = {4, 5, 7, 1};
+	if (amount == 0)
+		return;
+	emit_rex(sf);
+	emit8(0xC1);
+	emit8(0xC0 | ext[type] << 3 | host);
+	emit8(amount);
+}
+
+static void emit_call(uintptr_t fn) {
+	emit_mov_imm(RAX, fn);
+	emit8(0xFF); // call rax
+	emit8(0xD0);
+}
+
+static void emit_return(void) {
+	emit8(0x5B); // pop rbx
+	emit8(0xC3); // ret
+}
+
+static void emit_return_pc(uint64_t pc) {
+	emit_mov_imm(RAX, pc);
+	emit_return();
+}
+
+// leaves the block like dispatch_after_store() does when a store hits translated code
+static void emit_dirty_check(uint64_t next_pc) {
+	emit_mov_imm(RAX, (uintptr_t)&cur_blocks->dirty);
+	emit8(0x80); // cmp byte [rax], 0
+	emit8(0x38);
+	emit8(0x00);
+	emit8(0x74); // je over the exit
+	uint8_t *skip = code++;
+	emit_return_pc(next_pc);
+	*skip = code - (skip + 1);
+}
+
+// calls the handler of {d} on a copy followed by a return, rather than the rest of the block.
+// a store leaves the block if it hit translated code
+static void emit_handler_call(const DecodedInstr *d, bool is_store) {
+	JitState *j = cur_jit;
+	DecodedInstr *call = &j->calls[j->calls_used];
+	j->calls_used += 2;
+	call[0] = *d;
+	decode_return(&call[1]);
+	emit_mov_imm(RDI, (uintptr_t)call);
+	emit_call((uintptr_t)d->handler);
+	if (is_store)
+		emit_dirty_check((uint64_t)d->pc + 4);
+}
+
+// rcx := shifted register operand of DP (Register) instructions
+static void emit_shifted_rm(const DecodedInstr *d) {
+	emit_load_reg(RCX, d->rm, d->sf);
+	emit_shift(RCX, d->shift, d->amount, d->sf);
+	if (d->inv_mask)
+		emit_not(RCX, d->sf);
+}
+
+// opc 0 or 2 is add or sub with the second operand in rcx
+static void emit_arith(const DecodedInstr *d, unsigned opc) {
+	emit_load_reg(RAX, d->rn, d->sf);
+	emit_alu(opc == 0 ? ALU_ADD : ALU_SUB, RAX, RCX, d->sf);
+	emit_store_reg(d->rd, RAX);
+}
+
+// opc 0-2 is and, orr, eor with the second operand in rcx
+static void emit_logic(const DecodedInstr *d, unsigned opc) {
+	static const uint8_t ops[] = {ALU_AND, ALU_OR, ALU_XOR};
+	emit_load_reg(RAX, d->rn, d->sf);
+	emit_alu(ops[opc], RAX, RCX, d->sf);
+	emit_store_reg(d->rd, RAX);
+}
+
+static void emit_multiply(const DecodedInstr *d) {
+	bool negate = extract_bits(d->raw, 15, 1);
+	emit_load_reg(RAX, d->rn, d->sf);
+	emit_load_reg(RCX, d->rm, d->sf);
+	emit_imul(RAX, RCX, d->sf);
+	emit_load_reg(RDX, d->ra, d->sf);
+	emit_alu(negate ? ALU_SUB : ALU_ADD, RDX, RAX, d->sf);
+	emit_store_reg(d->rd, RDX);
+}
+
+static void emit_wide_mov(const DecodedInstr *d) {
+	uint32_t opc = extract_bits(d->raw, 29, 2);
+	uint64_t width_mask = make_mask(0, get_width(d->sf));
+	if (opc != 0x3) { // movn and movz are constants
+		emit_mov_imm(RAX, d->imm & width_mask);
+		emit_store_reg(d->rd, RAX);
+		return;
+	}
+	emit_load_reg(RAX, d->rd, d->sf);
+	emit_mov_imm(RCX, ~(0xFFFFULL << d->amount));
+	emit_alu(ALU_AND, RAX, RCX, true);
+	emit_mov_imm(RCX, d->imm);
+	emit_alu(ALU_OR, RAX, RCX, d->sf);
+	emit_store_reg(d->rd, RAX);
+}
+
+static void emit_ldr_literal(const DecodedInstr *d) {
+	emit8(0xBF); // mov edi, imm32
+	emit32(d->imm);
+	if (d->sf) {
+		emit_call((uintptr_t)mem_load64);
+	} else {
+		emit_call((uintptr_t)mem_load32);
+		emit8(0x89); // mov eax, eax, as only eax is defined for a uint32_t return
+		emit8(0xC0);
+	}
+	emit_store_reg(d->rd, RAX);
+}
+
+static void emit_b_cond(const DecodedInstr *d) {
+	emit8(0xBF); // mov edi, imm32
+	emit32(d->shift);
+	emit_call((uintptr_t)check_condition);
+	emit8(0x84); // test al, al
+	emit8(0xC0);
+	emit_mov_imm(RAX, d->imm);
+	emit_mov_imm(RCX, (uint64_t)d->pc + 4);
+	emit8(REX_W); // cmove rax, rcx
+	emit8(0x0F);
+	emit8(0x44);
+	emit8(0xC1);
+	emit_return();
+}
+
+// emits {d}, returns false if it is not supported, leaving the block to the interpreter
+static bool emit_instr(const DecodedInstr *d) {
+	unsigned opc = extract_bits(d->raw, 29, 2);
+	switch (d->cls) {
+	case CLASS_DP_IMM_ARITH:
+		if (opc & 1) { // adds, subs
+			emit_handler_call(d, false);
+			return true;
+		}
+		emit_mov_imm(RCX, d->imm);
+		emit_arith(d, opc);
+		return true;
+	case CLASS_DP_IMM_WIDE_MOV:
+		emit_wide_mov(d);
+		return true;
+	case CLASS_DP_REG_ARITH:
+	case CLASS_DP_REG_LOGIC:
+		if (d->cls == CLASS_DP_REG_ARITH ? opc & 1 : opc == 3) { // adds, subs, ands
+			emit_handler_call(d, false);
+			return true;
+		}
+		// x86 masks 32-bit shift counts to 5 bits, where the handlers would shift everything out
+		if (!d->sf && d->amount >= 32)
+			return false;
+		emit_shifted_rm(d);
+		if (d->cls == CLASS_DP_REG_ARITH)
+			emit_arith(d, opc);
+		else
+			emit_logic(d, opc);
+		return true;
+	case CLASS_DP_REG_MUL:
+		emit_multiply(d);
+		return true;
+	case CLASS_LDR_UOFFSET:
+	case CLASS_LDR_PREINDEXED:
+	case CLASS_LDR_POSTINDEXED:
+	case CLASS_LDR_REGOFFSET:
+		emit_handler_call(d, false);
+		return true;
+	case CLASS_STR_UOFFSET:
+	case CLASS_STR_PREINDEXED:
+	case CLASS_STR_POSTINDEXED:
+	case CLASS_STR_REGOFFSET:
+		emit_handler_call(d, true);
+		return true;
+	case CLASS_LDR_LITERAL:
+		emit_ldr_literal(d);
+		return true;
+	case CLASS_BRANCH:
+	case CLASS_BLOCK_END:
+		emit_return_pc(d->cls == CLASS_BRANCH ? d->imm : d->pc);
+		return true;
+	case CLASS_BRANCH_REG:
+		emit_load_reg(RAX, d->rn, false);
+		emit_return();
+		return true;
+	case CLASS_BRANCH_COND:
+		emit_b_cond(d);
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool jit_init(void) {
+	JitState *j = cur_jit;
+	if (!j->buffer) {
+		j->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+						 -1, 0);
+		if (j->buffer == MAP_FAILED) {
+			j->buffer = NULL;
+			return false;
+		}
+	}
+	if (!j->calls && !(j->calls = malloc(JIT_MAX_CALLS * 2 * sizeof(DecodedInstr))))
+		return false;
+	j->buffer_used = 0;
+	j->calls_used = 0;
+	return true;
+}
+
+void jit_destroy(void) {
+	JitState *j = cur_jit;
+	if (j->buffer) {
+		munmap(j->buffer, JIT_BUFFER_SIZE);
+		j->buffer = NULL;
+	}
+	free(j->calls);
+	j->calls = NULL;
+}
+
+// the buffer is only writable while a block is being compiled
+bool jit_compile(Block *block) {
+	JitState *j = cur_jit;
+	size_t worst_case = PROLOGUE_BYTES + (block->length + 1) * MAX_INSTR_BYTES;
+	if (!j->buffer || j->buffer_used + worst_case > JIT_BUFFER_SIZE ||
+		j->calls_used + 2 * block->length > 2 * JIT_MAX_CALLS)
+		return false;
+	if (mprotect(j->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+		return false;
+
+	uint8_t *start = j->buffer + j->buffer_used;
+	size_t calls_used = j->calls_used;
+	code = start;
+	emit8(0x53); // push rbx, which also aligns the stack for calls
+	emit8(REX_W); // mov rbx, rdi
+	emit8(0x89);
+	emit8(0xFB);
+
+	const DecodedInstr *d = block->instrs;
+	bool supported = true;
+	while (supported) {
+		supported = emit_instr(d);
+		if (ENDS_BLOCK(d->cls))
+			break;
+		d++;
+	}
+	if (supported) {
+		j->buffer_used = code - j->buffer;
+		block->native = (NativeBlock)(uintptr_t)start;
+	} else {
+		j->calls_used = calls_used;
+	}
+
+	mprotect(j->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+	return supported;
+}
+
+// compiled code goes with the blocks it was compiled from
+void jit_flush(void) {
+	cur_jit->buffer_used = 0;
+	cur_jit->calls_used = 0;
+}
+
+#else
+
+// no code generator for this host, every block stays interpreted
+
+bool jit_init(void) { return false; }
+
+void jit_destroy(void) {}
+
+bool jit_compile(Block *block) { return false; }
+
+void jit_flush(void) {}
+
+#endif
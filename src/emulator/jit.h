@@ -0,0 +1,32 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "block_cache.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 50 // interpreted runs of a block before it is compiled
+#endif
+#define JIT_BUFFER_SIZE (1 << 20)
+#define JIT_MAX_CALLS (1 << 14) // instructions compiled to a call of their handler
+
+// compiled code of one emulated machine, all functions below work on cur_jit
+typedef struct JitState {
+	uint8_t *buffer;
+	size_t buffer_used;
+	DecodedInstr *calls; // pairs of an instruction and a return for its handler to run on
+	size_t calls_used;
+} JitState;
+
+// selected per thread, a single-core program can just use the default one
+extern _Thread_local JitState *cur_jit;
+
+bool jit_init(void);
+void jit_destroy(void);
+
+bool jit_compile(Block *block);
+void jit_flush(void);
+
+#endif
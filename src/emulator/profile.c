@@ -0,0 +1,125 @@
+#include "profile.h"
+#include "block_cache.h"
+#include "emu_memory.h"
+#include "emu_registers.h"
+#include "fde.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PROFILE_PCS (MEMORY_SIZE / 4)
+
+Profile *profile_create(void) {
+	Profile *profile = calloc(1, sizeof(Profile));
+	assert(profile);
+	// zeroed pages are only touched where code actually runs
+	profile->pc_count = calloc(PROFILE_PCS, sizeof(uint64_t));
+	profile->pc_class = calloc(PROFILE_PCS, sizeof(uint8_t));
+	assert(profile->pc_count && profile->pc_class);
+	return profile;
+}
+
+void profile_destroy(Profile *profile) {
+	if (!profile)
+		return;
+	free(profile->pc_count);
+	free(profile->pc_class);
+	free(profile);
+}
+
+static inline void record(Profile *profile, const DecodedInstr *d) {
+	profile->class_count[d->cls]++;
+	profile->pc_count[d->pc / 4]++;
+	profile->pc_class[d->pc / 4] = d->cls;
+}
+
+// counts the first {executed} instructions of {block}
+void profile_block(Profile *profile, const Block *block, uint64_t executed) {
+	for (uint64_t i = 0; i < executed; ++i) {
+		record(profile, &block->instrs[i]);
+	}
+}
+
+// executes and counts the single instruction {instr} at pc, like decode_and_execute()
+void profile_step(Profile *profile, uint32_t instr) {
+	DecodedInstr d[2];
+	decode(instr, pc_load(), &d[0]);
+	decode_block_end(pc_load() + 4, &d[1]);
+	d[0].handler(&d[0]);
+	record(profile, &d[0]);
+}
+
+// adds the counts of {from} to {into}
+void profile_merge(Profile *into, const Profile *from) {
+	for (int cls = 0; cls < CLASS_COUNT; ++cls) {
+		into->class_count[cls] += from->class_count[cls];
+	}
+	for (size_t i = 0; i < PROFILE_PCS; ++i) {
+		if (from->pc_count[i]) {
+			into->pc_count[i] += from->pc_count[i];
+			into->pc_class[i] = from->pc_class[i];
+		}
+	}
+}
+
+static _Thread_local const uint64_t *sort_counts; // qsort has no context argument
+
+static int by_count_desc(const void *a, const void *b) {
+	uint64_t x = sort_counts[*(const uint32_t *)a];
+	uint64_t y = sort_counts[*(const uint32_t *)b];
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static double percent(uint64_t part, uint64_t total) { return total ? 100.0 * part / total : 0; }
+
+// writes instruction classes by executions and the PROFILE_HOT_SPOTS most executed guest pcs
+void profile_report(const Profile *profile, FILE *out) {
+	uint64_t total = 0;
+	for (int cls = 0; cls < CLASS_COUNT; ++cls) {
+		total += profile->class_count[cls];
+	}
+	fprintf(out, "%" PRIu64 " instructions\n\n", total);
+
+	fprintf(out, "%-16s %14s %7s\n", "class", "executed", "share");
+	int classes[CLASS_COUNT];
+	for (int cls = 0; cls < CLASS_COUNT; ++cls) {
+		classes[cls] = cls;
+	}
+	for (int i = 1; i < CLASS_COUNT; ++i) { // insertion sort, there are only a few classes
+		for (int j = i; j > 0 && profile->class_count[classes[j]] >
+									 profile->class_count[classes[j - 1]];
+			 --j) {
+			int tmp = classes[j];
+			classes[j] = classes[j - 1];
+			classes[j - 1] = tmp;
+		}
+	}
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		int cls = classes[i];
+		uint64_t count = profile->class_count[cls];
+		if (!count)
+			break;
+		fprintf(out, "%-16s %14" PRIu64 " %6.2f%%\n", instr_class_names[cls], count,
+				percent(count, total));
+	}
+
+	uint32_t *pcs = malloc(PROFILE_PCS * sizeof(uint32_t));
+	assert(pcs);
+	size_t used = 0;
+	for (uint32_t i = 0; i < PROFILE_PCS; ++i) {
+		if (profile->pc_count[i])
+			pcs[used++] = i;
+	}
+	sort_counts = profile->pc_count;
+	qsort(pcs, used, sizeof(uint32_t), by_count_desc);
+
+	fprintf(out, "\n%-10s %14s %7s  %s\n", "pc", "executed", "share", "class");
+	for (size_t i = 0; i < used && i < PROFILE_HOT_SPOTS; ++i) {
+		uint64_t count = profile->pc_count[pcs[i]];
+		fprintf(out, "0x%08" PRIx32 " %14" PRIu64 " %6.2f%%  %s\n", pcs[i] * 4, count,
+				percent(count, total), instr_class_names[profile->pc_class[pcs[i]]]);
+	}
+	free(pcs);
+}
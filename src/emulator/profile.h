@@ -0,0 +1,28 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "block_cache.h"
+#include "fde.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROFILE_HOT_SPOTS 20 // guest pcs listed in a report
+
+// executed instructions by instruction class and by guest pc. there is no host time, which can
+// only be taken per block and says little about any one handler, while two clock reads per
+// block cost more than the counting
+typedef struct Profile {
+	uint64_t class_count[CLASS_COUNT];
+	uint64_t *pc_count; // indexed by pc / 4
+	uint8_t *pc_class;	// class of the instruction last seen at each pc
+} Profile;
+
+Profile *profile_create(void);
+void profile_destroy(Profile *profile);
+
+void profile_block(Profile *profile, const Block *block, uint64_t executed);
+void profile_step(Profile *profile, uint32_t instr);
+void profile_merge(Profile *into, const Profile *from);
+void profile_report(const Profile *profile, FILE *out);
+
+#endif
@@ -0,0 +1,118 @@
+#include "smp.h"
+#include "cpu.h"
+#include "emu_memory.h"
+#include "emu_registers.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// longest "Core N:" line in front of a core's registers
+#define CORE_LABEL_SIZE 16
+
+// one core's run on its own thread
+typedef struct {
+	CpuState *cpu;
+	uint64_t max_instrs;
+	bool halted;
+} CoreRun;
+
+// creates {num_cores} cores over one cleared memory, all cores but the first share its memory
+Smp *smp_create(unsigned num_cores, bool use_jit) {
+	assert(num_cores > 0 && num_cores <= SMP_MAX_CORES);
+	Smp *smp = calloc(1, sizeof(Smp));
+	assert(smp);
+	smp->num_cores = num_cores;
+	smp->cores[0] = cpu_create(use_jit);
+	for (unsigned i = 1; i < num_cores; ++i) {
+		smp->cores[i] = cpu_create_core(smp->cores[0], use_jit);
+	}
+	return smp;
+}
+
+// the cores sharing memory go before the one owning it
+void smp_destroy(Smp *smp) {
+	for (unsigned i = smp->num_cores; i-- > 0;) {
+		cpu_destroy(smp->cores[i]);
+	}
+	free(smp);
+}
+
+// resets every core and loads the bin file {filename} into the memory they share, false if it
+// could not be opened. core i starts at {entries}[i], or at 0 without {entries}, with i in x0
+// so cores starting at the same place can tell each other apart
+bool smp_load(Smp *smp, char *filename, const uint64_t *entries) {
+	for (unsigned i = 1; i < smp->num_cores; ++i) {
+		cpu_reset(smp->cores[i]);
+	}
+	if (!cpu_load(smp->cores[0], filename))
+		return false;
+	for (unsigned i = 0; i < smp->num_cores; ++i) {
+		cpu_set_pc(smp->cores[i], entries ? entries[i] : 0);
+		cpu_set_register(smp->cores[i], 0, i);
+	}
+	return true;
+}
+
+static void *core_thread(void *arg) {
+	CoreRun *run = arg;
+	run->halted = cpu_run_until(run->cpu, CPU_NO_STOP_PC, run->max_instrs) == CPU_HALTED;
+	return NULL;
+}
+
+// runs every core on its own thread, the first on the calling one, until each has halted or
+// executed {max_instrs} more instructions. only returns once all cores have stopped, true if
+// they all halted
+bool smp_run(Smp *smp, uint64_t max_instrs) {
+	CoreRun runs[SMP_MAX_CORES];
+	pthread_t threads[SMP_MAX_CORES];
+	bool started[SMP_MAX_CORES] = {false};
+	for (unsigned i = 0; i < smp->num_cores; ++i) {
+		runs[i] = (CoreRun){.cpu = smp->cores[i], .max_instrs = max_instrs};
+	}
+	for (unsigned i = 1; i < smp->num_cores; ++i) {
+		started[i] = pthread_create(&threads[i], NULL, core_thread, &runs[i]) == 0;
+		if (!started[i])
+			fprintf(stderr, "Failed to create thread for core %u\n", i);
+	}
+	core_thread(&runs[0]);
+	bool halted = true;
+	for (unsigned i = 0; i < smp->num_cores; ++i) {
+		if (i > 0 && started[i])
+			pthread_join(threads[i], NULL);
+		halted = halted && runs[i].halted;
+	}
+	return halted;
+}
+
+uint64_t smp_instructions(Smp *smp) {
+	uint64_t instructions = 0;
+	for (unsigned i = 0; i < smp->num_cores; ++i) {
+		instructions += cpu_instructions(smp->cores[i]);
+	}
+	return instructions;
+}
+
+// like cpu_export(), with the registers, pc and flags of each core under a "Core N:" line in
+// front of the memory they share. a single core is written exactly like cpu_export()
+void smp_export(Smp *smp, FILE *out) {
+	if (smp->num_cores == 1) {
+		cpu_export(smp->cores[0], out);
+		return;
+	}
+	cpu_bind(smp->cores[0]);
+	char *buffer =
+		malloc(smp->num_cores * (CORE_LABEL_SIZE + REGISTERS_EXPORT_SIZE) + mem_export_size());
+	assert(buffer);
+	char *end = buffer;
+	for (unsigned i = 0; i < smp->num_cores; ++i) {
+		cpu_bind(smp->cores[i]);
+		end += sprintf(end, "Core %u:\n", i);
+		end = format_registers(end);
+	}
+	end = format_memory(end);
+	fwrite(buffer, 1, end - buffer, out);
+	free(buffer);
+}
@@ -0,0 +1,36 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SMP_MAX_CORES 64
+
+// a machine with several cores, each run on its own host thread. core 0 owns the memory and the
+// others share it through cpu_create_core(), so every core has its own pc, registers, flags,
+// block cache and JIT.
+//
+// memory the cores share is accessed through host atomics, so racing accesses are defined on
+// any host. aligned accesses are single-copy atomic and unaligned ones only per byte, as on ARM,
+// while every load acquires and every store releases. that is stronger than ARM orders plain
+// accesses, but there are no barrier or exclusive instructions, so cores hand work over through
+// flags they poll and a flag seen set carries everything stored before it. a store into code is
+// picked up by other cores at their next block boundary, as long as it is ordered before they
+// first run that code
+typedef struct Smp {
+	unsigned num_cores;
+	CpuState *cores[SMP_MAX_CORES];
+} Smp;
+
+Smp *smp_create(unsigned num_cores, bool use_jit);
+void smp_destroy(Smp *smp);
+
+bool smp_load(Smp *smp, char *filename, const uint64_t *entries);
+bool smp_run(Smp *smp, uint64_t max_instrs);
+
+uint64_t smp_instructions(Smp *smp);
+void smp_export(Smp *smp, FILE *out);
+
+#endif
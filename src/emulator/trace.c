@@ -0,0 +1,262 @@
+#include "trace.h"
+#include "bit_utils.h"
+#include "emu_memory.h"
+#include "emu_registers.h"
+#include "fde.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MASK (TRACE_RING_SIZE - 1)
+#define WRITE_BUFFER_SIZE (1 << 20) // encoded records the writer collects per fwrite
+#define MAX_RECORD_BYTES 64
+#define WRITER_IDLE_US 100 // how long the writer sleeps when the ring is empty
+
+// first byte of an encoded record, saying which fields follow the raw instruction
+#define REC_PC_JUMP 0x01 // pc is not the previous one plus 4, varint pc follows
+#define REC_REGS_SHIFT 1 // bits 1-2: number of register deltas
+#define REC_FLAGS 0x08	 // nzcv changed, byte follows
+#define REC_STORE 0x10	 // varint address and varint value follow
+#define REC_STORE64 0x20 // store was 8 bytes rather than 4
+
+static uint8_t *put_varint(uint8_t *p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static bool get_varint(FILE *in, uint64_t *value) {
+	*value = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		int c = getc(in);
+		if (c == EOF)
+			return false;
+		*value |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// register deltas are mostly small, of either sign
+static uint64_t zigzag(uint64_t delta) { return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63); }
+
+static uint64_t unzigzag(uint64_t value) { return (value >> 1) ^ -(value & 1); }
+
+// encodes {r} as the difference to the state in {codec} and updates it
+static size_t encode(TraceCodec *codec, const TraceRecord *r, uint8_t *buf) {
+	uint8_t *p = buf + 1;
+	uint8_t header = r->num_regs << REC_REGS_SHIFT;
+	if (r->pc != codec->next_pc) {
+		header |= REC_PC_JUMP;
+		p = put_varint(p, r->pc);
+	}
+	codec->next_pc = r->pc + 4;
+	memcpy(p, &r->raw, 4);
+	p += 4;
+	for (unsigned i = 0; i < r->num_regs; ++i) {
+		*p++ = r->regs[i];
+		p = put_varint(p, zigzag(r->reg_values[i] - codec->registers[r->regs[i]]));
+		codec->registers[r->regs[i]] = r->reg_values[i];
+	}
+	if (r->nzcv != codec->nzcv) {
+		header |= REC_FLAGS;
+		*p++ = r->nzcv;
+		codec->nzcv = r->nzcv;
+	}
+	if (r->store_bytes) {
+		header |= REC_STORE | (r->store_bytes == 8 ? REC_STORE64 : 0);
+		p = put_varint(p, r->store_addr);
+		p = put_varint(p, r->store_value);
+	}
+	buf[0] = header;
+	return p - buf;
+}
+
+static void *trace_writer(void *arg) {
+	Trace *trace = arg;
+	uint8_t *buf = malloc(WRITE_BUFFER_SIZE);
+	assert(buf);
+	size_t used = 0;
+	size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+	while (1) {
+		size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+		if (head == tail) {
+			// the emulator only sets closing after its last record
+			if (atomic_load(&trace->closing) &&
+				atomic_load_explicit(&trace->head, memory_order_acquire) == tail)
+				break;
+			usleep(WRITER_IDLE_US);
+			continue;
+		}
+		for (; tail != head; ++tail) {
+			if (used > WRITE_BUFFER_SIZE - MAX_RECORD_BYTES) {
+				fwrite(buf, 1, used, trace->out);
+				used = 0;
+			}
+			used += encode(&trace->codec, &trace->ring[tail & RING_MASK], buf + used);
+		}
+		atomic_store_explicit(&trace->tail, tail, memory_order_release);
+	}
+	fwrite(buf, 1, used, trace->out);
+	free(buf);
+	return NULL;
+}
+
+// creates {filename} and starts its writer thread, NULL if either fails
+Trace *trace_open(const char *filename) {
+	Trace *trace = calloc(1, sizeof(Trace));
+	assert(trace);
+	trace->ring = malloc(TRACE_RING_SIZE * sizeof(TraceRecord));
+	assert(trace->ring);
+	trace->out = fopen(filename, "wb");
+	if (!trace->out) {
+		free(trace->ring);
+		free(trace);
+		return NULL;
+	}
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace->out);
+	if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+		fclose(trace->out);
+		free(trace->ring);
+		free(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+// writes out every record still in the ring and closes the file, false if writing failed
+bool trace_close(Trace *trace) {
+	atomic_store(&trace->closing, true);
+	pthread_join(trace->writer, NULL);
+	bool ok = !ferror(trace->out);
+	ok = fclose(trace->out) == 0 && ok;
+	free(trace->ring);
+	free(trace);
+	return ok;
+}
+
+static void push(Trace *trace, const TraceRecord *r) {
+	size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+		sched_yield(); // the writer is behind
+	}
+	trace->ring[head & RING_MASK] = *r;
+	atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+static bool is_store(uint8_t cls) {
+	return cls == CLASS_STR_UOFFSET || cls == CLASS_STR_PREINDEXED ||
+		   cls == CLASS_STR_POSTINDEXED || cls == CLASS_STR_REGOFFSET;
+}
+
+// address the store {d} is about to write to
+static uint32_t store_address(const DecodedInstr *d) {
+	uint64_t base = register_load_x(d->rn);
+	switch (d->cls) {
+	case CLASS_STR_UOFFSET:
+		return (uint32_t)(base + d->imm * (d->sf ? 8 : 4));
+	case CLASS_STR_PREINDEXED:
+		return (uint32_t)(base + sign_extend(d->imm, 9));
+	case CLASS_STR_REGOFFSET:
+		return (uint32_t)(base + register_load_x(d->rm));
+	default: // post-indexed
+		return (uint32_t)base;
+	}
+}
+
+static void note_register(TraceRecord *r, uint8_t reg, uint64_t before) {
+	uint64_t after = register_load_x(reg);
+	if (after != before) {
+		r->regs[r->num_regs] = reg;
+		r->reg_values[r->num_regs++] = after;
+	}
+}
+
+// executes and records the single instruction {instr} at pc, like decode_and_execute().
+// only the registers an instruction can write, rd and the base of a load/store, are compared
+void trace_step(Trace *trace, uint32_t instr) {
+	DecodedInstr d[2];
+	uint64_t pc = pc_load();
+	decode(instr, pc, &d[0]);
+	decode_block_end(pc + 4, &d[1]);
+	TraceRecord r = {.pc = (uint32_t)pc, .raw = instr};
+	uint64_t rd_before = register_load_x(d[0].rd);
+	uint64_t rn_before = register_load_x(d[0].rn);
+	if (is_store(d[0].cls)) {
+		r.store_bytes = d[0].sf ? 8 : 4;
+		r.store_addr = store_address(&d[0]);
+		// taken from rd rather than read back, which on an MMIO register would go to the device
+		r.store_value = r.store_bytes == 8 ? rd_before : (uint32_t)rd_before;
+	}
+
+	d[0].handler(&d[0]);
+
+	note_register(&r, d[0].rd, rd_before);
+	if (d[0].rn != d[0].rd)
+		note_register(&r, d[0].rn, rn_before);
+	r.nzcv = getN() << 3 | getZ() << 2 | getC() << 1 | getV();
+	push(trace, &r);
+}
+
+// checks that {in} starts like a trace file and readies {codec} for its first record
+bool trace_read_header(FILE *in, TraceCodec *codec) {
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	*codec = (TraceCodec){0};
+	return fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+		   !memcmp(magic, TRACE_MAGIC, sizeof(magic));
+}
+
+// reads the next record of {in} into {r}, false at the end of the trace or if it is cut short
+bool trace_read(FILE *in, TraceCodec *codec, TraceRecord *r) {
+	int header = getc(in);
+	if (header == EOF)
+		return false;
+	*r = (TraceRecord){.num_regs = (header >> REC_REGS_SHIFT) & 3};
+	if (r->num_regs > TRACE_MAX_REGS)
+		return false;
+	uint64_t value;
+	if (header & REC_PC_JUMP) {
+		if (!get_varint(in, &value))
+			return false;
+		codec->next_pc = (uint32_t)value;
+	}
+	r->pc = codec->next_pc;
+	codec->next_pc += 4;
+	if (fread(&r->raw, 1, 4, in) != 4)
+		return false;
+	for (unsigned i = 0; i < r->num_regs; ++i) {
+		int reg = getc(in);
+		if (reg == EOF || reg >= NUM_REGISTERS || !get_varint(in, &value))
+			return false;
+		r->regs[i] = reg;
+		codec->registers[reg] += unzigzag(value);
+		r->reg_values[i] = codec->registers[reg];
+	}
+	if (header & REC_FLAGS) {
+		int nzcv = getc(in);
+		if (nzcv == EOF)
+			return false;
+		codec->nzcv = nzcv;
+	}
+	r->nzcv = codec->nzcv;
+	if (header & REC_STORE) {
+		r->store_bytes = header & REC_STORE64 ? 8 : 4;
+		if (!get_varint(in, &value))
+			return false;
+		r->store_addr = (uint32_t)value;
+		if (!get_varint(in, &r->store_value))
+			return false;
+	}
+	return true;
+}
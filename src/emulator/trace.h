@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "emu_registers.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "ARMTRC1\n"
+#define TRACE_RING_SIZE (1 << 16) // records buffered for the writer, must be a power of 2
+#define TRACE_MAX_REGS 2		  // a load with writeback changes two registers
+
+// what one executed instruction did
+typedef struct TraceRecord {
+	uint32_t pc;
+	uint32_t raw;
+	uint8_t num_regs; // registers whose value changed
+	uint8_t regs[TRACE_MAX_REGS];
+	uint8_t nzcv;		 // flags after the instruction
+	uint8_t store_bytes; // 0 unless the instruction stored to memory
+	uint32_t store_addr;
+	uint64_t reg_values[TRACE_MAX_REGS];
+	uint64_t store_value;
+} TraceRecord;
+
+// state both sides of the file format keep, so records can be stored as differences to it.
+// that comes to 7 to 12 bytes per instruction on the programs in bench/, stores and multiplies
+// costing the most
+typedef struct TraceCodec {
+	uint32_t next_pc;
+	uint64_t registers[NUM_REGISTERS];
+	uint8_t nzcv;
+} TraceCodec;
+
+// trace file being written. the emulating thread puts records into a single-producer
+// single-consumer ring, which a writer thread drains, encodes and writes out
+typedef struct Trace {
+	TraceRecord *ring;
+	_Alignas(64) atomic_size_t head; // next record the emulator writes
+	_Alignas(64) atomic_size_t tail; // next record the writer reads
+	atomic_bool closing;
+	FILE *out;
+	TraceCodec codec; // only used by the writer
+	pthread_t writer;
+} Trace;
+
+Trace *trace_open(const char *filename);
+bool trace_close(Trace *trace);
+void trace_step(Trace *trace, uint32_t instr);
+
+bool trace_read_header(FILE *in, TraceCodec *codec);
+bool trace_read(FILE *in, TraceCodec *codec, TraceRecord *record);
+
+#endif
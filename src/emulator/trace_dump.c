@@ -0,0 +1,45 @@
+#include "trace.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// prints a trace written by emulate --trace, one instruction per line
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	FILE *in = fopen(argv[1], "rb");
+	if (!in) {
+		perror("Failed to open trace");
+		return EXIT_FAILURE;
+	}
+	TraceCodec codec;
+	if (!trace_read_header(in, &codec)) {
+		fprintf(stderr, "%s is not a trace\n", argv[1]);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	TraceRecord r;
+	uint64_t count = 0;
+	while (trace_read(in, &codec, &r)) {
+		printf("%08" PRIx32 ": %08" PRIx32 " %c%c%c%c", r.pc, r.raw, r.nzcv & 8 ? 'N' : '-',
+			   r.nzcv & 4 ? 'Z' : '-', r.nzcv & 2 ? 'C' : '-', r.nzcv & 1 ? 'V' : '-');
+		for (unsigned i = 0; i < r.num_regs; ++i) {
+			printf(" X%02u=%016" PRIx64, r.regs[i], r.reg_values[i]);
+		}
+		if (r.store_bytes == 8)
+			printf(" [%08" PRIx32 "]=%016" PRIx64, r.store_addr, r.store_value);
+		else if (r.store_bytes)
+			printf(" [%08" PRIx32 "]=%08" PRIx64, r.store_addr, r.store_value);
+		printf("\n");
+		count++;
+	}
+	int status = feof(in) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (status != EXIT_SUCCESS)
+		fprintf(stderr, "%s is cut short after %" PRIu64 " instructions\n", argv[1], count);
+	fclose(in);
+	return status;
+}
@@ -1,63 +1,126 @@
 #ifndef BIT_UTILS_H
 #define BIT_UTILS_H
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
-
-uint64_t set_bit(uint64_t value, unsigned pos);
-uint64_t clear_bit(uint64_t value, unsigned pos);
-uint64_t toggle_bit(uint64_t value, unsigned pos);
-uint64_t get_bit(uint64_t value, unsigned pos);
-
-uint64_t extract_bits(uint64_t value, unsigned lsb, unsigned width);
-uint64_t insert_bits(uint64_t original, uint64_t field, unsigned lsb, unsigned width);
-
-uint64_t make_mask(unsigned lsb, unsigned width);
-bool is_aligned(uint64_t value, unsigned alignment);
-
-uint64_t sign_extend(uint64_t value, unsigned original_width);
-
-uint64_t rotate_left(uint64_t value, unsigned shift, unsigned width);
-uint64_t rotate_right(uint64_t value, unsigned shift, unsigned width);
-
-unsigned popcount(uint64_t value);
-unsigned clz(uint64_t value);
-unsigned ctz(uint64_t value);
-unsigned find_msb(uint64_t value);
-unsigned find_lsb(uint64_t value);
-
-bool fits_in_bits_signed(int64_t value, unsigned width);
-bool fits_in_bits_unsigned(uint64_t value, unsigned width);
-
-unsigned get_width(uint64_t sf);
-
-uint64_t apply_shift(uint64_t value, unsigned shift_type, unsigned shift_amount, bool sf);
-
-void add(uint64_t rd, uint64_t rn, uint64_t op, uint64_t sf);
-void adds(uint64_t rd, uint64_t rn, uint64_t op, uint64_t sf);
-
-void sub(uint64_t rd, uint64_t rn, uint64_t op, uint64_t sf);
-void subs(uint64_t rd, uint64_t rn, uint64_t op, uint64_t sf);
-
-void madd(uint64_t rd, uint64_t rn, uint64_t rm, uint64_t ra, uint64_t sf);
-void msub(uint64_t rd, uint64_t rn, uint64_t rm, uint64_t ra, uint64_t sf);
-
-uint64_t ldr_uoffset(uint64_t rt, uint64_t xn, uint64_t imm12, uint64_t sf);
-void str_uoffset(uint64_t rt, uint64_t xn, uint64_t imm12, uint64_t sf);
-uint64_t ldr_preindexed(uint64_t rt, uint64_t xn, uint64_t simm9, uint64_t sf);
-void str_preindexed(uint64_t rt, uint64_t xn, uint64_t simm9, uint64_t sf);
-uint64_t ldr_postindexed(uint64_t rt, uint64_t xn, uint64_t simm9, uint64_t sf);
-void str_postindexed(uint64_t rt, uint64_t xn, uint64_t simm9, uint64_t sf);
-uint64_t ldr_regoffset(uint64_t rt, uint64_t xn, uint64_t xm, uint64_t sf);
-void str_regoffset(uint64_t rt, uint64_t xn, uint64_t xm, uint64_t sf);
-uint64_t ldr_literal(uint64_t rt, uint64_t simm19, uint64_t sf);
-uint64_t logical_shift_left(uint64_t value, unsigned shift, unsigned width);
-uint64_t logical_shift_right(uint64_t value, unsigned shift, unsigned width);
-uint64_t arithmetic_shift_right(uint64_t value, unsigned shift, unsigned width);
-
-void execute_and(uint64_t rd, uint64_t rn, uint64_t op2, uint64_t sf);
-void execute_orr(uint64_t rd, uint64_t rn, uint64_t op2, uint64_t sf);
-void execute_eor(uint64_t rd, uint64_t rn, uint64_t op2, uint64_t sf);
-void execute_ands(uint64_t rd, uint64_t rn, uint64_t op2, uint64_t sf);
+#include <stdlib.h>
+
+// all static inline so the decoder and handlers can fold them in without a call
+
+static inline uint64_t set_bit(uint64_t value, unsigned pos) { return value | (1ULL << pos); }
+static inline uint64_t clear_bit(uint64_t value, unsigned pos) { return value & ~(1ULL << pos); }
+static inline uint64_t toggle_bit(uint64_t value, unsigned pos) { return value ^ (1ULL << pos); }
+static inline uint64_t get_bit(uint64_t value, unsigned pos) { return (value >> pos) & 1; }
+
+// extracts {width} bits from bit {lsb} to bit {lsb + width - 1}
+static inline uint64_t extract_bits(uint64_t value, unsigned lsb, unsigned width) {
+	if (width == 64)
+		return value;
+	return (value >> lsb) & ((1ULL << width) - 1);
+}
+
+static inline uint64_t make_mask(unsigned lsb, unsigned width) {
+	assert(lsb < 64);
+	if (width >= 64) // need special case as shift by more than 63 is undefined
+		return (uint64_t)-1 << lsb;
+	return ((1ULL << width) - 1) << lsb;
+}
+
+// insert bits {field} into bits {lsb} to {lsb + width - 1} of {original}
+static inline uint64_t insert_bits(uint64_t original, uint64_t field, unsigned lsb,
+								   unsigned width) {
+	uint64_t mask = make_mask(lsb, width);
+	return (original & ~mask) | ((field << lsb) & mask);
+}
+
+static inline bool is_aligned(uint64_t value, unsigned alignment) {
+	return (value & (alignment - 1)) == 0;
+}
+
+// sign-extend a {value} assuming it is {original_width} wide
+static inline uint64_t sign_extend(uint64_t value, unsigned original_width) {
+	// if msb if 1 then it is negative, else it is positive so return unmodified
+	if (get_bit(value, original_width - 1)) {
+		uint64_t mask = make_mask(original_width, 64 - original_width);
+		return value | mask;
+	}
+	return value;
+}
+
+// rotate {value} {shift} bits left, assuming {value} is {width} bits wide
+static inline uint64_t rotate_left(uint64_t value, unsigned shift, unsigned width) {
+	// mask to remove overflowed bits
+	uint64_t mask = make_mask(0, width);
+	return ((value << shift) | (value >> (width - shift))) & mask;
+}
+
+// same as above but right
+static inline uint64_t rotate_right(uint64_t value, unsigned shift, unsigned width) {
+	uint64_t mask = make_mask(0, width);
+	return ((value >> shift) | (value << (width - shift))) & mask;
+}
+
+// unused
+static inline unsigned popcount(uint64_t value) { return __builtin_popcountll(value); }
+
+static inline unsigned clz(uint64_t value) { return __builtin_clzll(value); }
+
+static inline unsigned ctz(uint64_t value) { return __builtin_ctzll(value); }
+
+static inline unsigned find_msb(uint64_t value) { return 63 - __builtin_clzll(value); }
+
+static inline unsigned find_lsb(uint64_t value) { return __builtin_ctzll(value); }
+
+// designed to check overflow...
+static inline bool fits_in_bits_signed(int64_t value, unsigned width) {
+	return value <= (1 << (width - 1)) - 1 && value >= -(1 << (width - 1));
+}
+
+static inline bool fits_in_bits_unsigned(uint64_t value, unsigned width) {
+	return value <= (1 << width) - 1;
+}
+
+// helper to determine width
+static inline unsigned get_width(uint64_t sf) { return sf ? 64 : 32; }
+
+static inline uint64_t logical_shift_left(uint64_t value, unsigned shift, unsigned width) {
+	return (value << shift) & make_mask(0, width);
+}
+
+static inline uint64_t logical_shift_right(uint64_t value, unsigned shift, unsigned width) {
+	return value >> shift;
+}
+
+static inline uint64_t arithmetic_shift_right(uint64_t value, unsigned shift, unsigned width) {
+	uint64_t mask = make_mask(0, width);
+	return sign_extend((value >> shift), width - shift) & mask;
+}
+
+// helper for executing shifts
+static inline uint64_t apply_shift(uint64_t value, unsigned shift_type, unsigned shift_amount,
+								   bool sf) {
+	switch (shift_type) {
+	case 0:
+		return logical_shift_left(value, shift_amount, get_width(sf));
+	case 1:
+		return logical_shift_right(value, shift_amount, get_width(sf));
+	case 2:
+		return arithmetic_shift_right(value, shift_amount, get_width(sf));
+	case 3:
+		return rotate_right(value, shift_amount, get_width(sf));
+	default:
+		exit(EXIT_FAILURE);
+	}
+}
+
+// writes the low {digits} hex digits of {value} to {out}, lowercase and zero-padded, no '\0'.
+// returns the end of what was written
+static inline char *format_hex(char *out, uint64_t value, unsigned digits) {
+	for (unsigned i = digits; i-- > 0; value >>= 4) {
+		out[i] = "0123456789abcdef"[value & 0xF];
+	}
+	return out + digits;
+}
 
 #endif
@@ -1,4 +1,5 @@
 #include "emu_memory.h"
+#include "bit_utils.h"
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -7,79 +8,106 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define BUFFERSIZE 1024
-#define MEM_CHECK_BOUNDS(addr, size) assert((addr) + (size) <= MEMORY_SIZE)
 
-// using real memory to emulate memory
-static uint8_t *memory = NULL;
+static MemoryState default_memory;
+_Thread_local MemoryState *cur_memory = &default_memory;
 
+// fresh zero pages over all of memory, dropping a mapped binary too
+static void map_zero_pages(uint8_t *base) {
+	void *mapped = mmap(base, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	assert(mapped != MAP_FAILED);
+	(void)mapped;
+}
+
+// the host only backs the pages the guest touches
 void mem_init(void) {
-	if (!memory) {
-		memory = malloc(MEMORY_SIZE);
-		assert(memory);
-		memset(memory, 0, MEMORY_SIZE);
+	MemoryState *m = cur_memory;
+	if (!m->base) {
+		void *space = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		assert(space != MAP_FAILED);
+		m->base = space;
+		memset(m->dirty_map, 0, sizeof(m->dirty_map));
 	}
 }
 
 void mem_destroy(void) {
-	free(memory);
-	memory = NULL;
+	MemoryState *m = cur_memory;
+	if (m->base) {
+		munmap(m->base, MEMORY_SIZE);
+		m->base = NULL;
+	}
+	memset(m->dirty_map, 0, sizeof(m->dirty_map));
+	mem_clear_code_marks();
+	m->num_mmio = 0;
 }
 
-// All this assumes Little-Endian
-
-uint8_t mem_load8(uint32_t addr) {
-	MEM_CHECK_BOUNDS(addr, 1);
-	return memory[addr];
+// zeroes all of memory again for the next program, keeping the mapping
+void mem_reset(void) {
+	MemoryState *m = cur_memory;
+	map_zero_pages(m->base);
+	memset(m->dirty_map, 0, sizeof(m->dirty_map));
+	mem_clear_code_marks();
 }
 
-uint16_t mem_load16(uint32_t addr) {
-	MEM_CHECK_BOUNDS(addr, 2);
-	return memory[addr] | ((uint16_t)memory[addr + 1] << 8);
+// maps {device} at [{base}, {base} + {size}) past the end of memory, false if that overlaps memory
+// or there is no room for another region. either hook may be NULL, loads then read as 0 and
+// stores are dropped
+bool mem_map_mmio(uint32_t base, uint32_t size, mmio_load_hook load, mmio_store_hook store,
+				  void *device) {
+	MemoryState *m = cur_memory;
+	if (base < MEMORY_SIZE || size == 0 || base + (uint64_t)size > (1ULL << 32) ||
+		m->num_mmio == MEM_MAX_MMIO)
+		return false;
+	m->mmio[m->num_mmio++] = (MmioRegion){base, size, load, store, device};
+	return true;
 }
 
-uint32_t mem_load32(uint32_t addr) {
-	MEM_CHECK_BOUNDS(addr, 4);
-	uint64_t to_return = 0;
-	for (int i = 0; i < 4; ++i) {
-		to_return |= ((uint64_t)memory[addr + i] << (i * 8));
+// the region {size} bytes at {addr} fall in, a guest access outside all of them is fatal
+static const MmioRegion *find_mmio(uint32_t addr, size_t size) {
+	for (unsigned i = 0; i < cur_memory->num_mmio; ++i) {
+		const MmioRegion *r = &cur_memory->mmio[i];
+		if (addr - r->base < r->size && addr - r->base + size <= r->size)
+			return r;
 	}
-	return to_return;
+	fprintf(stderr, "Access to unmapped address 0x%08" PRIx32 "\n", addr);
+	abort();
 }
 
-uint64_t mem_load64(uint32_t addr) {
-	MEM_CHECK_BOUNDS(addr, 8);
-	uint64_t to_return = 0;
-	for (int i = 0; i < 8; ++i) {
-		to_return |= ((uint64_t)memory[addr + i] << (i * 8));
-	}
-	return to_return;
+uint64_t mem_mmio_load(uint32_t addr, size_t size) {
+	const MmioRegion *r = find_mmio(addr, size);
+	return r->load ? r->load(r->device, addr - r->base, size) : 0;
 }
 
-void mem_store8(uint32_t addr, uint8_t value) {
-	MEM_CHECK_BOUNDS(addr, 1);
-	memory[addr] = value;
+// stores to devices are neither tracked as dirty nor as code
+void mem_mmio_store(uint32_t addr, uint64_t value, size_t size) {
+	const MmioRegion *r = find_mmio(addr, size);
+	if (r->store)
+		r->store(r->device, addr - r->base, value, size);
 }
 
-void mem_store16(uint32_t addr, uint16_t value) {
-	MEM_CHECK_BOUNDS(addr, 2);
-	memory[addr] = value & 0xFF;
-	memory[addr + 1] = (value >> 8) & 0xFF;
-}
+void mem_set_code_hook(code_write_hook hook) { cur_memory->code_hook = hook; }
 
-void mem_store32(uint32_t addr, uint32_t value) {
-	MEM_CHECK_BOUNDS(addr, 4);
-	for (int i = 0; i < 4; ++i) {
-		memory[addr + i] = (value >> 8 * i) & 0xFF;
-	}
+// only has an effect once a hook is set
+void mem_mark_code(uint32_t addr) {
+	MEM_CHECK_BOUNDS(addr, 1);
+	if (cur_memory->code_hook)
+		mem_set_bit(cur_memory->code_map, addr >> CODE_GRANULE_SHIFT);
 }
 
-void mem_store64(uint32_t addr, uint64_t value) {
-	MEM_CHECK_BOUNDS(addr, 8);
-	for (int i = 0; i < 8; ++i) {
-		memory[addr + i] = (value >> 8 * i) & 0xFF;
-	}
+void mem_clear_code_marks(void) {
+	memset(cur_memory->code_map, 0, sizeof(cur_memory->code_map));
 }
 
 // debug function
@@ -88,41 +116,227 @@ void mem_dump(uint32_t addr, size_t length) {
 	for (size_t i = 0; i < length; ++i) {
 		if (i % 16 == 0)
 			printf("\n%08lx: ", addr + i);
-		printf("%02x ", memory[addr + i]);
+		printf("%02x ", cur_memory->base[addr + i]);
 	}
 	printf("\n");
 }
 
+#define EXPORT_LINE_SIZE 21 // "0x%08x: %08x\n"
+#define SCAN_CHUNK 64		 // bytes checked for zero at once
+
+// whether the SCAN_CHUNK bytes at {p} are all zero
+static inline bool chunk_is_zero(const uint8_t *p) {
+#ifdef __SSE2__
+	__m128i a = _mm_loadu_si128((const __m128i *)p);
+	__m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+	__m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+	__m128i d = _mm_loadu_si128((const __m128i *)(p + 48));
+	__m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF;
+#else
+	uint64_t any = 0;
+	for (size_t i = 0; i < SCAN_CHUNK; i += 8) {
+		uint64_t word;
+		memcpy(&word, p + i, sizeof(word));
+		any |= word;
+	}
+	return !any;
+#endif
+}
+
+// whether the SCAN_CHUNK bytes at {a} and {b} are the same
+static inline bool chunks_equal(const uint8_t *a, const uint8_t *b) {
+#if defined(__AVX2__)
+	__m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)a),
+								   _mm256_loadu_si256((const __m256i *)b));
+	__m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + 32)),
+								   _mm256_loadu_si256((const __m256i *)(b + 32)));
+	return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(lo, hi)) == 0xFFFFFFFF;
+#elif defined(__SSE2__)
+	__m128i same = _mm_set1_epi8(-1);
+	for (size_t i = 0; i < SCAN_CHUNK; i += 16) {
+		same = _mm_and_si128(same, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+												  _mm_loadu_si128((const __m128i *)(b + i))));
+	}
+	return _mm_movemask_epi8(same) == 0xFFFF;
+#else
+	return !memcmp(a, b, SCAN_CHUNK);
+#endif
+}
+
+// reports every word of memory that differs from {reference}, a MEMORY_SIZE image of what memory
+// should hold, to {report} and returns how many there were. only pages written by the guest or
+// set in {ref_pages} are compared, all others are zero on both sides
+size_t mem_diff(const uint8_t *reference, const uint8_t *ref_pages, FILE *report) {
+	size_t mismatches = 0;
+	for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+		if (!mem_page_dirty(page) && !(ref_pages[page / 8] & (1 << (page % 8))))
+			continue;
+		uint32_t start = page << MEM_PAGE_SHIFT;
+		for (uint32_t chunk = start; chunk < start + (1 << MEM_PAGE_SHIFT); chunk += SCAN_CHUNK) {
+			if (chunks_equal(cur_memory->base + chunk, reference + chunk))
+				continue;
+			for (uint32_t addr = chunk; addr < chunk + SCAN_CHUNK; addr += 4) {
+				uint32_t expected;
+				memcpy(&expected, reference + addr, sizeof(expected));
+				expected = MEM_LE32(expected);
+				uint32_t value = mem_load32(addr);
+				if (value != expected) {
+					fprintf(report, "0x%08" PRIx32 ": %08" PRIx32 ", expected %08" PRIx32 "\n", addr,
+							value, expected);
+					mismatches++;
+				}
+			}
+		}
+	}
+	return mismatches;
+}
+
+// most bytes format_memory() writes, which depends on how many pages were written
+size_t mem_export_size(void) {
+	size_t pages = 0;
+	for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+		pages += mem_page_dirty(page);
+	}
+	return 32 + pages * ((1 << MEM_PAGE_SHIFT) / 4) * EXPORT_LINE_SIZE;
+}
+
+// formats the non-zero words of memory into {out}, returning the end of what was written.
+// pages that were never written are known to be zero, and zero chunks of the rest are skipped
+char *format_memory(char *out) {
+	memcpy(out, "Non-Zero Memory:\n", 17);
+	out += 17;
+	for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+		if (!mem_page_dirty(page))
+			continue;
+		uint32_t start = page << MEM_PAGE_SHIFT;
+		for (uint32_t chunk = start; chunk < start + (1 << MEM_PAGE_SHIFT); chunk += SCAN_CHUNK) {
+			if (chunk_is_zero(cur_memory->base + chunk))
+				continue;
+			for (uint32_t addr = chunk; addr < chunk + SCAN_CHUNK; addr += 4) {
+				uint32_t value = mem_load32(addr);
+				if (!value)
+					continue;
+				*out++ = '0';
+				*out++ = 'x';
+				out = format_hex(out, addr, 8);
+				*out++ = ':';
+				*out++ = ' ';
+				out = format_hex(out, value, 8);
+				*out++ = '\n';
+			}
+		}
+	}
+	return out;
+}
+
 // for exporting final state
 void export_memory(FILE *out) {
-	fprintf(out, "Non-Zero Memory:\n");
-	for (size_t i = 0; i < MEMORY_SIZE; i += 4) {
-		uint32_t memVal = mem_load32(i);
-		if (memVal) {
-			fprintf(out, "0x%08zx: %08" PRIx32 "\n", i, memVal);
-		}
+	char *buffer = malloc(mem_export_size());
+	assert(buffer);
+	fwrite(buffer, 1, format_memory(buffer) - buffer, out);
+	free(buffer);
+}
+
+// maps a regular bin file copy-on-write over the start of guest memory, so loading costs nothing
+// up front and only the pages the program touches are ever read in
+static bool map_binary(FILE *objcode) {
+	struct stat st;
+	if (fstat(fileno(objcode), &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	if (st.st_size == 0 || st.st_size > MEMORY_SIZE)
+		return false;
+	// the tail of the last page past the end of the file reads as zeros
+	void *mapped = mmap(cur_memory->base, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+						fileno(objcode), 0);
+	if (mapped == MAP_FAILED)
+		return false;
+	for (uint32_t page = 0; page <= (st.st_size - 1) >> MEM_PAGE_SHIFT; ++page) {
+		cur_memory->dirty_map[page / 8] |= 1 << (page % 8);
 	}
+	return true;
 }
 
-// loads bin file into memory
-void binary_loader(char *filename) {
+// loads bin file into memory, false if it could not be opened or does not fit
+bool binary_loader(char *filename) {
 	FILE *objcode = fopen(filename, "rb");
 
 	if (!objcode) {
 		perror("Failed to open binary file");
-		return;
+		return false;
+	}
+
+	if (map_binary(objcode)) {
+		fclose(objcode);
+		return true;
 	}
 
+	// not mappable (e.g. a pipe or a file too big for memory), so copy it in instead
 	uint8_t buffer[BUFFERSIZE];
 	size_t offset = 0;
 
 	size_t bytes_read = fread(buffer, 1, BUFFERSIZE, objcode);
 	while (bytes_read != 0) { // reads bytes until EOF
-		for (size_t i = 0; i < bytes_read; ++i) {
-			mem_store8(offset + i, buffer[i]); // flushes buffer into memory
+		if (offset + bytes_read > MEMORY_SIZE) { // checked in release builds too
+			fprintf(stderr, "Binary file does not fit in %d bytes of memory\n", MEMORY_SIZE);
+			fclose(objcode);
+			return false;
 		}
+		memcpy(cur_memory->base + offset, buffer, bytes_read); // flushes buffer into memory
+		mem_mark_dirty(offset, bytes_read);
 		offset += bytes_read;
 		bytes_read = fread(buffer, 1, BUFFERSIZE, objcode);
 	}
 	fclose(objcode);
+	return true;
+}
+
+// writes the contents of every written page in address order, the pages themselves are
+// listed by the dirty map
+bool mem_save_pages(FILE *out) {
+	for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+		if (!mem_page_dirty(page))
+			continue;
+		const uint8_t *data = cur_memory->base + ((size_t)page << MEM_PAGE_SHIFT);
+		if (fwrite(data, 1, 1 << MEM_PAGE_SHIFT, out) != 1 << MEM_PAGE_SHIFT)
+			return false;
+	}
+	return true;
+}
+
+// maps the pages set in {page_map} copy-on-write from {fd}, where mem_save_pages() wrote them
+// starting at {offset}. consecutive pages are mapped together, and they are read in instead if
+// the host's pages are too large to map them on their own
+bool mem_map_pages(int fd, uint64_t offset, const uint8_t *page_map) {
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+	uint64_t saved = 0;
+	for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+		saved += (page_map[page / 8] >> (page % 8)) & 1;
+	}
+	if ((uint64_t)st.st_size < offset + (saved << MEM_PAGE_SHIFT))
+		return false; // mapping past the end of the file would fault on access
+
+	uint32_t page = 0;
+	while (page < MEM_NUM_PAGES) {
+		if (!(page_map[page / 8] & (1 << (page % 8)))) {
+			page++;
+			continue;
+		}
+		uint32_t end = page;
+		while (end < MEM_NUM_PAGES && (page_map[end / 8] & (1 << (end % 8))))
+			end++;
+		uint8_t *addr = cur_memory->base + ((size_t)page << MEM_PAGE_SHIFT);
+		size_t length = (size_t)(end - page) << MEM_PAGE_SHIFT;
+		if (mmap(addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) ==
+				MAP_FAILED &&
+			pread(fd, addr, length, offset) != (ssize_t)length)
+			return false;
+		for (; page < end; ++page) {
+			cur_memory->dirty_map[page / 8] |= 1 << (page % 8);
+		}
+		offset += length;
+	}
+	return true;
 }
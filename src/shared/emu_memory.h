@@ -1,31 +1,266 @@
 #ifndef EMU_MEMORY_H
 #define EMU_MEMORY_H
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-#define MEMORY_SIZE (1 << 21) // 1 MiB
+#define MEMORY_SIZE (1 << 21) // 2 MiB
+#define CODE_GRANULE_SHIFT 4  // granularity at which stores are checked for hitting code
+#define MEM_PAGE_SHIFT 12	  // granularity at which written memory is tracked
+#define MEM_NUM_PAGES (MEMORY_SIZE >> MEM_PAGE_SHIFT)
+
+#define MEM_MAX_MMIO 4 // device regions that can be mapped past the end of memory
+
+// called on stores into memory marked as code, so decoded copies can be dropped
+typedef void (*code_write_hook)(uint32_t addr, size_t size);
+
+// a device's registers, given the {offset} into its region of a {size} byte access
+typedef uint64_t (*mmio_load_hook)(void *device, uint32_t offset, size_t size);
+typedef void (*mmio_store_hook)(void *device, uint32_t offset, uint64_t value, size_t size);
+
+typedef struct MmioRegion {
+	uint32_t base;
+	uint32_t size;
+	mmio_load_hook load;
+	mmio_store_hook store;
+	void *device;
+} MmioRegion;
+
+// memory of one emulated machine, all functions below work on cur_memory
+typedef struct MemoryState {
+	uint8_t *base; // using real memory to emulate memory
+	uint8_t dirty_map[MEM_NUM_PAGES / 8]; // bitmap of pages that were written
+	// bitmap of granules instructions were decoded from, and who to tell when they are written
+	uint8_t code_map[(MEMORY_SIZE >> CODE_GRANULE_SHIFT) / 8];
+	code_write_hook code_hook;
+	MmioRegion mmio[MEM_MAX_MMIO]; // kept over mem_reset(), like devices over a reboot
+	unsigned num_mmio;
+	bool shared;		  // run by several cores at once, see smp.h
+	unsigned code_writes; // stores into code so far, so cores sharing it notice each other's
+} MemoryState;
+
+// selected per thread, a single-core program can just use the default one
+extern _Thread_local MemoryState *cur_memory;
+
+// a {size} byte access that does not fit in memory goes to the MMIO region mapped past its end,
+// or aborts if there is none, so it is the only bounds check. {size} is a constant, which leaves
+// plain memory accesses one compare they never take
+#define MEM_PAST_END(addr, size) __builtin_expect((addr) > MEMORY_SIZE - (size), 0)
+
+#define MEM_CHECK_BOUNDS(addr, size) assert((uint64_t)(addr) + (size) <= MEMORY_SIZE)
+
+// guest memory is little-endian
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MEM_LE16(value) __builtin_bswap16(value)
+#define MEM_LE32(value) __builtin_bswap32(value)
+#define MEM_LE64(value) __builtin_bswap64(value)
+#else
+#define MEM_LE16(value) (value)
+#define MEM_LE32(value) (value)
+#define MEM_LE64(value) (value)
+#endif
 
 void mem_init(void);
 
 void mem_destroy(void);
+void mem_reset(void);
+
+static inline bool mem_test_bit(const uint8_t *map, uint32_t bit) {
+	return __atomic_load_n(&map[bit / 8], __ATOMIC_RELAXED) & (1 << (bit % 8));
+}
+
+// cores sharing memory may set bits in the same byte at once, so this is an atomic or. a bit
+// that is already set, the common case, is only read
+static inline void mem_set_bit(uint8_t *map, uint32_t bit) {
+	if (!mem_test_bit(map, bit))
+		__atomic_fetch_or(&map[bit / 8], 1 << (bit % 8), __ATOMIC_RELAXED);
+}
+
+static inline bool mem_is_code(uint32_t addr) {
+	return mem_test_bit(cur_memory->code_map, addr >> CODE_GRANULE_SHIFT);
+}
+
+// tells the hook about stores to code, checking both ends as a store may straddle two granules.
+// only called after the store itself, which was in range
+static inline void mem_check_code(uint32_t addr, size_t size) {
+	if (mem_is_code(addr) || mem_is_code(addr + size - 1))
+		cur_memory->code_hook(addr, size);
+}
 
-uint8_t mem_load8(uint32_t addr);
-uint16_t mem_load16(uint32_t addr);
-uint32_t mem_load32(uint32_t addr);
-uint64_t mem_load64(uint32_t addr);
+static inline bool mem_page_dirty(uint32_t page) {
+	return mem_test_bit(cur_memory->dirty_map, page);
+}
 
-void mem_store8(uint32_t addr, uint8_t value);
-void mem_store16(uint32_t addr, uint16_t value);
-void mem_store32(uint32_t addr, uint32_t value);
-void mem_store64(uint32_t addr, uint64_t value);
+// marks the pages at both ends of a store as written, only called after the store itself
+static inline void mem_mark_dirty(uint32_t addr, size_t size) {
+	mem_set_bit(cur_memory->dirty_map, addr >> MEM_PAGE_SHIFT);
+	mem_set_bit(cur_memory->dirty_map, (addr + size - 1) >> MEM_PAGE_SHIFT);
+}
+
+// memory shared by several cores may be accessed by them at once, so it goes through host
+// atomics ordered as smp.h describes: aligned accesses are single-copy atomic, others only per
+// byte, as on ARM. {addr} is checked already and the value is the guest's, not in memory order
+static inline uint64_t mem_shared_load(uint32_t addr, size_t size) {
+	uint8_t *p = cur_memory->base + addr;
+	if (addr % size == 0) {
+		switch (size) {
+		case 1:
+			return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+		case 2:
+			return MEM_LE16(__atomic_load_n((uint16_t *)p, __ATOMIC_ACQUIRE));
+		case 4:
+			return MEM_LE32(__atomic_load_n((uint32_t *)p, __ATOMIC_ACQUIRE));
+		default:
+			return MEM_LE64(__atomic_load_n((uint64_t *)p, __ATOMIC_ACQUIRE));
+		}
+	}
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; ++i)
+		value |= (uint64_t)__atomic_load_n(&p[i], __ATOMIC_ACQUIRE) << (8 * i);
+	return value;
+}
+
+static inline void mem_shared_store(uint32_t addr, uint64_t value, size_t size) {
+	uint8_t *p = cur_memory->base + addr;
+	if (addr % size == 0) {
+		switch (size) {
+		case 1:
+			__atomic_store_n(p, value, __ATOMIC_RELEASE);
+			return;
+		case 2:
+			__atomic_store_n((uint16_t *)p, MEM_LE16((uint16_t)value), __ATOMIC_RELEASE);
+			return;
+		case 4:
+			__atomic_store_n((uint32_t *)p, MEM_LE32((uint32_t)value), __ATOMIC_RELEASE);
+			return;
+		default:
+			__atomic_store_n((uint64_t *)p, MEM_LE64(value), __ATOMIC_RELEASE);
+			return;
+		}
+	}
+	for (size_t i = 0; i < size; ++i)
+		__atomic_store_n(&p[i], (uint8_t)(value >> (8 * i)), __ATOMIC_RELEASE);
+}
+
+bool mem_map_mmio(uint32_t base, uint32_t size, mmio_load_hook load, mmio_store_hook store,
+				  void *device);
+uint64_t mem_mmio_load(uint32_t addr, size_t size);
+void mem_mmio_store(uint32_t addr, uint64_t value, size_t size);
+
+static inline uint8_t mem_load8(uint32_t addr) {
+	if (MEM_PAST_END(addr, 1))
+		return mem_mmio_load(addr, 1);
+	if (cur_memory->shared)
+		return mem_shared_load(addr, 1);
+	return cur_memory->base[addr];
+}
+
+static inline uint16_t mem_load16(uint32_t addr) {
+	if (MEM_PAST_END(addr, 2))
+		return mem_mmio_load(addr, 2);
+	if (cur_memory->shared)
+		return mem_shared_load(addr, 2);
+	uint16_t value;
+	memcpy(&value, cur_memory->base + addr, sizeof(value));
+	return MEM_LE16(value);
+}
+
+static inline uint32_t mem_load32(uint32_t addr) {
+	if (MEM_PAST_END(addr, 4))
+		return mem_mmio_load(addr, 4);
+	if (cur_memory->shared)
+		return mem_shared_load(addr, 4);
+	uint32_t value;
+	memcpy(&value, cur_memory->base + addr, sizeof(value));
+	return MEM_LE32(value);
+}
+
+static inline uint64_t mem_load64(uint32_t addr) {
+	if (MEM_PAST_END(addr, 8))
+		return mem_mmio_load(addr, 8);
+	if (cur_memory->shared)
+		return mem_shared_load(addr, 8);
+	uint64_t value;
+	memcpy(&value, cur_memory->base + addr, sizeof(value));
+	return MEM_LE64(value);
+}
+
+static inline void mem_store8(uint32_t addr, uint8_t value) {
+	if (MEM_PAST_END(addr, 1)) {
+		mem_mmio_store(addr, value, 1);
+		return;
+	}
+	if (cur_memory->shared)
+		mem_shared_store(addr, value, 1);
+	else
+		cur_memory->base[addr] = value;
+	mem_mark_dirty(addr, 1);
+	mem_check_code(addr, 1);
+}
+
+static inline void mem_store16(uint32_t addr, uint16_t value) {
+	if (MEM_PAST_END(addr, 2)) {
+		mem_mmio_store(addr, value, 2);
+		return;
+	}
+	if (cur_memory->shared) {
+		mem_shared_store(addr, value, 2);
+	} else {
+		value = MEM_LE16(value);
+		memcpy(cur_memory->base + addr, &value, sizeof(value));
+	}
+	mem_mark_dirty(addr, 2);
+	mem_check_code(addr, 2);
+}
+
+static inline void mem_store32(uint32_t addr, uint32_t value) {
+	if (MEM_PAST_END(addr, 4)) {
+		mem_mmio_store(addr, value, 4);
+		return;
+	}
+	if (cur_memory->shared) {
+		mem_shared_store(addr, value, 4);
+	} else {
+		value = MEM_LE32(value);
+		memcpy(cur_memory->base + addr, &value, sizeof(value));
+	}
+	mem_mark_dirty(addr, 4);
+	mem_check_code(addr, 4);
+}
+
+static inline void mem_store64(uint32_t addr, uint64_t value) {
+	if (MEM_PAST_END(addr, 8)) {
+		mem_mmio_store(addr, value, 8);
+		return;
+	}
+	if (cur_memory->shared) {
+		mem_shared_store(addr, value, 8);
+	} else {
+		value = MEM_LE64(value);
+		memcpy(cur_memory->base + addr, &value, sizeof(value));
+	}
+	mem_mark_dirty(addr, 8);
+	mem_check_code(addr, 8);
+}
+
+void mem_set_code_hook(code_write_hook hook);
+void mem_mark_code(uint32_t addr);
+void mem_clear_code_marks(void);
 
 void mem_dump(uint32_t addr, size_t length);
 
+size_t mem_export_size(void);
+char *format_memory(char *out);
 void export_memory(FILE *out);
+size_t mem_diff(const uint8_t *reference, const uint8_t *ref_pages, FILE *report);
+
+bool binary_loader(char *filename);
 
-void binary_loader(char *filename);
+bool mem_save_pages(FILE *out);
+bool mem_map_pages(int fd, uint64_t offset, const uint8_t *page_map);
 
 #endif
@@ -1,167 +1,202 @@
 #include "emu_registers.h"
 #include "bit_utils.h"
 #include <assert.h>
-#include <inttypes.h>
-#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static RegisterState default_registers;
+_Thread_local RegisterState *cur_registers = &default_registers;
+
+void registers_init(void) { *cur_registers = (RegisterState){0}; }
+
+// nothing to free as the registers live in their RegisterState
+void registers_destroy(void) {}
+
+static void evaluate_flags(void) {
+	RegisterState *r = cur_registers;
+	if (r->flags_op == FLAGS_EVALUATED)
+		return;
+	unsigned msb = r->flags_width - 1;
+	bool n = get_bit(r->flags_result, msb);
+	bool z = r->flags_result == 0;
+	bool c = false;
+	bool v = false;
+	if (r->flags_op == FLAGS_ADD) {
+		c = r->flags_result < r->flags_a; // wrapped around
+		v = get_bit(~(r->flags_a ^ r->flags_b) & (r->flags_a ^ r->flags_result), msb);
+	} else if (r->flags_op == FLAGS_SUB) {
+		c = r->flags_a >= r->flags_b; // no borrow
+		v = get_bit((r->flags_a ^ r->flags_b) & (r->flags_a ^ r->flags_result), msb);
+	}
+	r->pstate = n << 3 | z << 2 | c << 1 | v;
+	r->flags_op = FLAGS_EVALUATED;
+}
 
-#define REGISTER_CHECK_BOUNDS(addr) assert((addr) <= NUM_REGISTERS)
-
-// using array of uint64_t to represent the registers
-static uint64_t *registers = NULL;
-// using bitmask to represent pstate, technically only lower nibble needed
-static uint8_t pstate = 0;
-static uint64_t pc = 0;
+static inline void record_flags(FlagsOp op, uint64_t a, uint64_t b, uint64_t result, bool sf) {
+	RegisterState *r = cur_registers;
+	r->flags_op = op;
+	r->flags_a = a;
+	r->flags_b = b;
+	r->flags_result = result;
+	r->flags_width = sf ? 64 : 32;
+}
 
-void registers_init(void) {
-	if (!registers) {
-		registers = calloc(NUM_REGISTERS, sizeof(uint64_t));
-		assert(registers);
-	}
+void flags_from_add(uint64_t a, uint64_t b, uint64_t result, bool sf) {
+	record_flags(FLAGS_ADD, a, b, result, sf);
 }
 
-void registers_destroy(void) {
-	if (registers) {
-		free(registers);
-		registers = NULL;
-	}
+void flags_from_sub(uint64_t a, uint64_t b, uint64_t result, bool sf) {
+	record_flags(FLAGS_SUB, a, b, result, sf);
 }
 
+// N and Z from {result}, C and V cleared
+void flags_from_logic(uint64_t result, bool sf) { record_flags(FLAGS_LOGIC, 0, 0, result, sf); }
+
 // all helper functions to set and clear PSTATE
 void setN(bool val) {
+	evaluate_flags();
 	if (val) {
-		pstate = set_bit(pstate, 3);
+		cur_registers->pstate = set_bit(cur_registers->pstate, 3);
 	} else {
-		pstate = clear_bit(pstate, 3);
+		cur_registers->pstate = clear_bit(cur_registers->pstate, 3);
 	}
 }
 
 void setZ(bool val) {
+	evaluate_flags();
 	if (val) {
-		pstate = set_bit(pstate, 2);
+		cur_registers->pstate = set_bit(cur_registers->pstate, 2);
 	} else {
-		pstate = clear_bit(pstate, 2);
+		cur_registers->pstate = clear_bit(cur_registers->pstate, 2);
 	}
 }
 
 void setC(bool val) {
+	evaluate_flags();
 	if (val) {
-		pstate = set_bit(pstate, 1);
+		cur_registers->pstate = set_bit(cur_registers->pstate, 1);
 	} else {
-		pstate = clear_bit(pstate, 1);
+		cur_registers->pstate = clear_bit(cur_registers->pstate, 1);
 	}
 }
 
 void setV(bool val) {
+	evaluate_flags();
 	if (val) {
-		pstate = set_bit(pstate, 0);
+		cur_registers->pstate = set_bit(cur_registers->pstate, 0);
 	} else {
-		pstate = clear_bit(pstate, 0);
+		cur_registers->pstate = clear_bit(cur_registers->pstate, 0);
 	}
 }
 
-bool getN(void) { return get_bit(pstate, 3); }
-
-bool getZ(void) { return get_bit(pstate, 2); }
-
-bool getC(void) { return get_bit(pstate, 1); }
+bool getN(void) {
+	evaluate_flags();
+	return get_bit(cur_registers->pstate, 3);
+}
 
-bool getV(void) { return get_bit(pstate, 0); }
+bool getZ(void) {
+	evaluate_flags();
+	return get_bit(cur_registers->pstate, 2);
+}
 
-uint64_t register_load(unsigned addr, bool sf) {
-	REGISTER_CHECK_BOUNDS(addr);
-	if (addr == NUM_REGISTERS)
-		return 0;
-	if (!sf) { // masks out top 32 bits, when in 32 bit mode, returning only bottom 32 bits
-		return registers[addr] & 0xFFFFFFFF;
-	}
-	return registers[addr];
+bool getC(void) {
+	evaluate_flags();
+	return get_bit(cur_registers->pstate, 1);
 }
 
-void register_store(unsigned addr, uint64_t value, bool sf) {
-	REGISTER_CHECK_BOUNDS(addr);
-	if (addr != NUM_REGISTERS) {
-		if (!sf) {
-			registers[addr] = value & 0xFFFFFFFF;
-		} else {
-			registers[addr] = value;
-		}
-	}
+bool getV(void) {
+	evaluate_flags();
+	return get_bit(cur_registers->pstate, 0);
 }
 
+// direct access to the NUM_REGISTERS general purpose registers, for generated code
+uint64_t *register_file(void) { return cur_registers->registers; }
+
 // as pc is 4-byte aligned, each pc jump is left-shifted twice
-void pc_jump(uint32_t offset) { pc += sign_extend((uint64_t)offset << 2, 34); }
+void pc_jump(uint32_t offset) { cur_registers->pc += sign_extend((uint64_t)offset << 2, 34); }
 
-void pc_jump_indirect(unsigned reg) { pc = register_load(reg, 0); }
+void pc_jump_indirect(unsigned reg) { cur_registers->pc = register_load(reg, 0); }
 
-void pc_jump_conditional(uint32_t offset, uint8_t cond) {
+// whether condition code {cond} of a conditional branch holds under the current PSTATE
+bool check_condition(uint8_t cond) {
 	switch (cond >> 1) { // use this as the LSB is whether to negate cond
 	case 0:
-		if ((cond & 1) ^ getZ())
-			pc += sign_extend(offset << 2, 21);
-		else
-			pc_jump(1);
-		break;
+		return (cond & 1) ^ getZ();
 	case 5:
-		if ((getN() == getV()) ^ (cond & 1))
-			pc += sign_extend(offset << 2, 21);
-		else
-			pc_jump(1);
-		break;
+		return (getN() == getV()) ^ (cond & 1);
 	case 6:
-		if (((getN() == getV()) && !getZ()) ^ (cond & 1))
-			pc += sign_extend(offset << 2, 21);
-		else
-			pc_jump(1);
-		break;
+		return ((getN() == getV()) && !getZ()) ^ (cond & 1);
 	case 7:
-		pc += sign_extend(offset << 2, 21);
-		break;
+		return true;
 	default:
 		assert(false);
+		return false;
 	}
 }
 
-// allows read-only access to pc
-uint64_t pc_load() { return pc; }
+void pc_jump_conditional(uint32_t offset, uint8_t cond) {
+	if (check_condition(cond))
+		cur_registers->pc += sign_extend(offset << 2, 21);
+	else
+		pc_jump(1);
+}
 
-// to export final state
-void export_normal_registers(FILE *out) {
-	int zero_padding = log10(NUM_REGISTERS) + 1;
-	fprintf(out, "Registers:\n");
-	for (size_t i = 0; i < NUM_REGISTERS; ++i) {
-		fprintf(out, "X%0*zd = %016" PRIx64 "\n", zero_padding, i, register_load(i, true));
+// allows read-only access to pc
+uint64_t pc_load() { return cur_registers->pc; }
+
+// for branches whose target was resolved at decode time
+void pc_store(uint64_t value) { cur_registers->pc = value; }
+
+// formats the final state of the registers into {out}, returning the end of what was written
+char *format_normal_registers(char *out) {
+	memcpy(out, "Registers:\n", 11);
+	out += 11;
+	for (unsigned i = 0; i < NUM_REGISTERS; ++i) {
+		*out++ = 'X';
+		*out++ = '0' + i / 10;
+		*out++ = '0' + i % 10;
+		memcpy(out, " = ", 3);
+		out = format_hex(out + 3, register_load(i, true), 16);
+		*out++ = '\n';
 	}
+	return out;
+}
+
+char *format_pc(char *out) {
+	memcpy(out, "PC = ", 5);
+	out = format_hex(out + 5, pc_load(), 16);
+	*out++ = '\n';
+	return out;
+}
+
+char *format_pstate(char *out) {
+	memcpy(out, "PSTATE : ", 9);
+	out += 9;
+	*out++ = getN() ? 'N' : '-';
+	*out++ = getZ() ? 'Z' : '-';
+	*out++ = getC() ? 'C' : '-';
+	*out++ = getV() ? 'V' : '-';
+	*out++ = '\n';
+	return out;
+}
+
+// all of the above, at most REGISTERS_EXPORT_SIZE bytes
+char *format_registers(char *out) { return format_pstate(format_pc(format_normal_registers(out))); }
+
+static void export_formatted(FILE *out, char *(*format)(char *)) {
+	char buffer[REGISTERS_EXPORT_SIZE];
+	fwrite(buffer, 1, format(buffer) - buffer, out);
 }
 
 // to export final state
-void export_pc(FILE *out) { fprintf(out, "PC = %016" PRIx64 "\n", pc_load()); }
+void export_normal_registers(FILE *out) { export_formatted(out, format_normal_registers); }
 
 // to export final state
-void export_pstate(FILE *out) {
-	fprintf(out, "PSTATE : ");
-	if (getN()) {
-		fprintf(out, "N");
-	} else {
-		fprintf(out, "-");
-	}
-	if (getZ()) {
-		fprintf(out, "Z");
-	} else {
-		fprintf(out, "-");
-	}
-	if (getC()) {
-		fprintf(out, "C");
-	} else {
-		fprintf(out, "-");
-	}
-	if (getV()) {
-		fprintf(out, "V\n");
-	} else {
-		fprintf(out, "-\n");
-	}
-}
+void export_pc(FILE *out) { export_formatted(out, format_pc); }
+
+// to export final state
+void export_pstate(FILE *out) { export_formatted(out, format_pstate); }
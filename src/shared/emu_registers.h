@@ -7,6 +7,29 @@
 #include <stdio.h>
 
 #define NUM_REGISTERS 31
+// register number 31 encodes the zero register in every instruction this emulator runs
+#define ZERO_REGISTER NUM_REGISTERS
+// most bytes format_registers() writes
+#define REGISTERS_EXPORT_SIZE (16 + NUM_REGISTERS * 24 + 24 + 16)
+
+// flags are evaluated lazily: flag-setting instructions only record their operands and result,
+// and pstate is brought up to date from them when a flag is actually read
+typedef enum { FLAGS_EVALUATED, FLAGS_ADD, FLAGS_SUB, FLAGS_LOGIC } FlagsOp;
+
+// registers of one core, all functions below work on cur_registers
+typedef struct RegisterState {
+	// indexed directly by the 5-bit register number: slot ZERO_REGISTER always reads as zero and
+	// stores to it land in the scratch slot after it, so no access has to test for it
+	uint64_t registers[NUM_REGISTERS + 2];
+	uint64_t pc;
+	uint8_t pstate; // bitmask, technically only lower nibble needed
+	uint8_t flags_op;
+	unsigned flags_width;
+	uint64_t flags_a, flags_b, flags_result; // all already truncated to flags_width
+} RegisterState;
+
+// selected per thread, a single-core program can just use the default one
+extern _Thread_local RegisterState *cur_registers;
 
 void registers_init(void);
 void registers_destroy(void);
@@ -21,14 +44,49 @@ bool getZ(void);
 bool getC(void);
 bool getV(void);
 
-uint64_t register_load(unsigned addr, bool sf);
-void register_store(unsigned addr, uint64_t value, bool sf);
+void flags_from_add(uint64_t a, uint64_t b, uint64_t result, bool sf);
+void flags_from_sub(uint64_t a, uint64_t b, uint64_t result, bool sf);
+void flags_from_logic(uint64_t result, bool sf);
+
+uint64_t *register_file(void);
+
+// X (64-bit) and W (32-bit) accesses, for callers that know the width when they are built
+static inline uint64_t register_load_x(unsigned addr) { return cur_registers->registers[addr]; }
+
+static inline uint64_t register_load_w(unsigned addr) {
+	return (uint32_t)cur_registers->registers[addr];
+}
+
+static inline void register_store_x(unsigned addr, uint64_t value) {
+	cur_registers->registers[addr + (addr == ZERO_REGISTER)] = value;
+}
+
+static inline void register_store_w(unsigned addr, uint64_t value) {
+	register_store_x(addr, (uint32_t)value);
+}
+
+// {sf} only picks a mask, so these stay branch free as well
+static inline uint64_t register_load(unsigned addr, bool sf) {
+	return cur_registers->registers[addr] & (0xFFFFFFFF | -(uint64_t)sf << 32);
+}
+
+static inline void register_store(unsigned addr, uint64_t value, bool sf) {
+	register_store_x(addr, value & (0xFFFFFFFF | -(uint64_t)sf << 32));
+}
+
+bool check_condition(uint8_t cond);
 
 void pc_jump(uint32_t offset);
 void pc_jump_indirect(unsigned reg);
 void pc_jump_conditional(uint32_t offset, uint8_t cond);
 
 uint64_t pc_load(void);
+void pc_store(uint64_t value);
+
+char *format_normal_registers(char *out);
+char *format_pc(char *out);
+char *format_pstate(char *out);
+char *format_registers(char *out);
 
 void export_normal_registers(FILE *out);
 void export_pc(FILE *out);
@@ -3,12 +3,28 @@
 #include "bit_utils.h"
 #include "emu_registers.h"
 #include "emu_memory.h"
+#include "fde.h"
 #include <assert.h>
-#include "emu_registers.h"
 
 #define W32 0
 #define X64 1
 
+#define ADD 0
+#define ADDS 1
+#define SUB 2
+#define SUBS 3
+#define MADD 0
+#define MSUB 1
+
+#define BUILD_ARITH_IMM(sf, opc, imm12, rn, rd) \
+	(((unsigned)(sf) << 31) | ((opc) << 29) | (4u << 26) | (2u << 23) | ((imm12) << 10) | \
+	 ((rn) << 5) | (rd))
+#define BUILD_ARITH_REG(sf, opc, rm, rn, rd) \
+	(((unsigned)(sf) << 31) | ((opc) << 29) | (0xBu << 24) | ((rm) << 16) | ((rn) << 5) | (rd))
+#define BUILD_MUL(sf, x, rm, ra, rn, rd) \
+	(((unsigned)(sf) << 31) | (0xD8u << 21) | ((rm) << 16) | ((x) << 15) | ((ra) << 10) | \
+	 ((rn) << 5) | (rd))
+
 int main(void) {
 	registers_init();
 
@@ -22,13 +38,13 @@ int main(void) {
 
 	/* add_imm: X64 */
 	register_store(1, 10, X64);
-	add_imm(0, 1, 5, X64);
+	decode_and_execute(BUILD_ARITH_IMM(X64, ADD, 5, 1, 0));
 	assert(register_load(0, X64) == 15);
 	printf("X64: add_imm passed\n");
 
 	/* adds_imm: X64 */
 	register_store(2, 0, X64);
-	adds_imm(3, 2, 1, X64);
+	decode_and_execute(BUILD_ARITH_IMM(X64, ADDS, 1, 2, 3));
 	assert(register_load(3, X64) == 1);
 	assert(!getZ());
 	assert(!getN());
@@ -38,13 +54,13 @@ int main(void) {
 
 	/* sub_imm: X64 */
 	register_store(1, 10, X64);
-	sub_imm(0, 1, 5, X64);
+	decode_and_execute(BUILD_ARITH_IMM(X64, SUB, 5, 1, 0));
 	assert(register_load(0, X64) == 5);
 	printf("X64: sub_imm passed\n");
 	
 	/* subs_imm: X64 */
 	register_store(2, 2, X64);
-	subs_imm(3, 2, 1, X64);
+	decode_and_execute(BUILD_ARITH_IMM(X64, SUBS, 1, 2, 3));
 	assert(register_load(3, X64) == 1);
 	assert(!getZ());
 	assert(!getN());
@@ -55,14 +71,14 @@ int main(void) {
 	/* add_reg: X64 */
 	register_store(1, 5, X64);
 	register_store(2, 7, X64);
-	add_reg(0, 1, 2, X64);
+	decode_and_execute(BUILD_ARITH_REG(X64, ADD, 2, 1, 0));
 	assert(register_load(0, X64) == 12);
 	printf("X64: add_reg passed\n");
 
 	/* adds_reg: X64 */
 	register_store(1, 5, X64);
 	register_store(2, 7, X64);
-	adds_reg(0, 1, 2, X64);
+	decode_and_execute(BUILD_ARITH_REG(X64, ADDS, 2, 1, 0));
 	assert(register_load(0, X64) == 12);
 	assert(!getZ());
 	assert(!getN());
@@ -73,14 +89,14 @@ int main(void) {
 	/* sub_reg: X64 */
 	register_store(1, 19, X64);
 	register_store(2, 7, X64);
-	sub_reg(0, 1, 2, X64);
+	decode_and_execute(BUILD_ARITH_REG(X64, SUB, 2, 1, 0));
 	assert(register_load(0, X64) == 12);
 	printf("X64: sub_reg passed\n");
 
 	/* subs_reg: X64 */
 	register_store(1, 19, X64);
 	register_store(2, 7, X64);
-	subs_reg(0, 1, 2, X64);
+	decode_and_execute(BUILD_ARITH_REG(X64, SUBS, 2, 1, 0));
 	assert(register_load(0, X64) == 12);
 	assert(!getZ());
 	assert(!getN());
@@ -93,7 +109,7 @@ int main(void) {
 	register_store(1, 2, X64);
 	register_store(2, 3, X64);
 	register_store(3, 4, X64);
-	madd(0, 1, 2, 3, X64);
+	decode_and_execute(BUILD_MUL(X64, MADD, 2, 3, 1, 0));
 	assert(register_load(0, X64) == 10);
 	printf("X64: madd passed\n");
 	
@@ -102,19 +118,19 @@ int main(void) {
 	register_store(1, 2, X64);
 	register_store(2, 3, X64);
 	register_store(3, 5, X64);
-	msub(0, 1, 2, 3, X64);
+	decode_and_execute(BUILD_MUL(X64, MSUB, 2, 3, 1, 0));
 	assert(register_load(0, X64) == -1);
 	printf("X64: msub passed\n");
 
 	/* add_imm: W32 */
 	register_store(1, 10, W32);
-	add_imm(0, 1, 5, W32);
+	decode_and_execute(BUILD_ARITH_IMM(W32, ADD, 5, 1, 0));
 	assert(register_load(0, W32) == 15);
 	printf("W32: add_imm passed\n");
 
 	/* adds_imm: W32 */
 	register_store(2, 0, W32);
-	adds_imm(3, 2, 1, W32);
+	decode_and_execute(BUILD_ARITH_IMM(W32, ADDS, 1, 2, 3));
 	assert(register_load(3, W32) == 1);
 	assert(!getZ());
 	assert(!getN());
@@ -124,13 +140,13 @@ int main(void) {
 
 	/* sub_imm: W32 */
 	register_store(1, 10, W32);
-	sub_imm(0, 1, 5, W32);
+	decode_and_execute(BUILD_ARITH_IMM(W32, SUB, 5, 1, 0));
 	assert(register_load(0, W32) == 5);
 	printf("W32: sub_imm passed\n");
 	
 	/* subs_imm: W32 */
 	register_store(2, 2, W32);
-	subs_imm(3, 2, 1, W32);
+	decode_and_execute(BUILD_ARITH_IMM(W32, SUBS, 1, 2, 3));
 	assert(register_load(3, W32) == 1);
 	assert(!getZ());
 	assert(!getN());
@@ -141,14 +157,14 @@ int main(void) {
 	/* add_reg: W32 */
 	register_store(1, 5, W32);
 	register_store(2, 7, W32);
-	add_reg(0, 1, 2, W32);
+	decode_and_execute(BUILD_ARITH_REG(W32, ADD, 2, 1, 0));
 	assert(register_load(0, W32) == 12);
 	printf("W32: add_reg passed\n");
 
 	/* adds_reg: W32 */
 	register_store(1, 5, W32);
 	register_store(2, 7, W32);
-	adds_reg(0, 1, 2, W32);
+	decode_and_execute(BUILD_ARITH_REG(W32, ADDS, 2, 1, 0));
 	assert(register_load(0, W32) == 12);
 	assert(!getZ());
 	assert(!getN());
@@ -159,14 +175,14 @@ int main(void) {
 	/* sub_reg: W32 */
 	register_store(1, 19, W32);
 	register_store(2, 7, W32);
-	sub_reg(0, 1, 2, W32);
+	decode_and_execute(BUILD_ARITH_REG(W32, SUB, 2, 1, 0));
 	assert(register_load(0, W32) == 12);
 	printf("W32: sub_reg passed\n");
 
 	/* subs_reg: W32 */
 	register_store(1, 19, W32);
 	register_store(2, 7, W32);
-	subs_reg(0, 1, 2, W32);
+	decode_and_execute(BUILD_ARITH_REG(W32, SUBS, 2, 1, 0));
 	assert(register_load(0, W32) == 12);
 	assert(!getZ());
 	assert(!getN());
@@ -178,7 +194,7 @@ int main(void) {
 	register_store(1, 2, W32);
 	register_store(2, 3, W32);
 	register_store(3, 4, W32);
-	madd(0, 1, 2, 3, W32);
+	decode_and_execute(BUILD_MUL(W32, MADD, 2, 3, 1, 0));
 	assert(register_load(0, W32) == 10);
 	printf("W32: madd passed\n");
 	
@@ -187,7 +203,7 @@ int main(void) {
 	register_store(1, 2, W32);
 	register_store(2, 3, W32);
 	register_store(3, 5, W32);
-	msub(0, 1, 2, 3, W32);
+	decode_and_execute(BUILD_MUL(W32, MSUB, 2, 3, 1, 0));
 	assert(sign_extend(register_load(0, W32), 32) == -1); // Sign extended since output is negative
 	printf("W32: msub passed\n");
 
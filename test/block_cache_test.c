@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include "emu_registers.h"
+#include "emu_memory.h"
+#include "fde.h"
+#include "block_cache.h"
+
+#define MOVZ_X1(imm16) (0xD2800001u | ((imm16) << 5))
+#define ADD_X1_1 0x91000421u
+#define B_BACK_2 0x17fffffeu
+#define HALT 0x8a000000u
+
+int main(void) {
+	registers_init();
+	mem_init();
+	block_cache_init();
+
+	mem_store32(0, MOVZ_X1(7));
+	mem_store32(4, ADD_X1_1);
+	mem_store32(8, B_BACK_2);
+
+	// block covers both instructions up to and including the branch
+	Block *b = block_cache_lookup(0);
+	assert(b->start == 0);
+	assert(b->length == 3);
+	assert(!b->halts);
+	assert(b->instrs[0].cls == CLASS_DP_IMM_WIDE_MOV);
+	assert(b->instrs[0].imm == 7);
+	assert(b->instrs[2].cls == CLASS_BRANCH);
+	assert(b->instrs[2].imm == 0);
+	printf("translate block: OK\n");
+
+	// lookups hit the same block
+	assert(block_cache_lookup(0) == b);
+	block_run(b);
+	assert(register_load(1, true) == 8);
+	assert(pc_load() == 0);
+	printf("run block: OK\n");
+
+	// successors are chained
+	Block *next = block_cache_next(b, 4);
+	assert(next->start == 4);
+	assert(b->next[0] == next);
+	assert(block_cache_next(b, 4) == next);
+	printf("chain blocks: OK\n");
+
+	// store over translated code flushes the cache
+	mem_store32(0, MOVZ_X1(9));
+	assert(cur_blocks->dirty);
+	b = block_cache_next(next, 0);
+	assert(!cur_blocks->dirty);
+	assert(b->instrs[0].imm == 9);
+	printf("invalidate on store32: OK\n");
+
+	// halt ends a block without being part of it
+	mem_store64(4, ((uint64_t)HALT << 32) | ADD_X1_1);
+	b = block_cache_next(b, 0);
+	assert(b->length == 2);
+	assert(b->halts);
+	assert(b->instrs[2].cls == CLASS_BLOCK_END);
+	block_run(b);
+	assert(register_load(1, true) == 10);
+	assert(pc_load() == 8);
+	printf("halt block: OK\n");
+
+	block_cache_destroy();
+	mem_destroy();
+	registers_destroy();
+	return EXIT_SUCCESS;
+}
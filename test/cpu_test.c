@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "emu_memory.h"
+#include "emu_registers.h"
+
+#define MOVZ_X1(imm16) (0xD2800001u | ((imm16) << 5))
+#define ADD_X1_1 0x91000421u
+#define B_BACK_2 0x17fffffeu
+#define HALT 0x8a000000u
+
+int main(void) {
+	CpuState *a = cpu_create(false);
+	CpuState *b = cpu_create(false);
+
+	// each machine has its own registers, flags and memory
+	cpu_bind(a);
+	register_store(0, 1, true);
+	mem_store32(0x100, 0xAAAA);
+	setZ(false);
+	cpu_bind(b);
+	assert(register_load(0, true) == 0);
+	assert(mem_load32(0x100) == 0);
+	assert(getZ());
+	cpu_bind(a);
+	assert(register_load(0, true) == 1);
+	assert(mem_load32(0x100) == 0xAAAA);
+	printf("separate state: OK\n");
+
+	// running one machine leaves the other untouched
+	mem_store32(0, MOVZ_X1(7));
+	mem_store32(4, HALT);
+	cpu_run(a);
+	assert(register_load(1, true) == 7);
+	assert(pc_load() == 4);
+	cpu_bind(b);
+	assert(register_load(1, true) == 0);
+	assert(pc_load() == 0);
+	printf("cpu_run: OK\n");
+
+	// reset clears everything again
+	cpu_reset(a);
+	assert(register_load(1, true) == 0);
+	assert(mem_load32(0x100) == 0);
+	assert(!mem_page_dirty(0));
+	printf("cpu_reset: OK\n");
+
+	// stepping executes one instruction at a time and stops in front of the halt
+	mem_store32(0, MOVZ_X1(1));
+	mem_store32(4, ADD_X1_1);
+	mem_store32(8, ADD_X1_1);
+	mem_store32(12, HALT);
+	assert(cpu_step(a));
+	assert(cpu_register(a, 1) == 1);
+	assert(cpu_pc(a) == 4);
+	printf("cpu_step: OK\n");
+
+	// running until a pc in the middle of a block stops exactly there
+	cpu_set_pc(a, 0);
+	assert(cpu_run_until(a, 8, CPU_NO_LIMIT) == CPU_REACHED_PC);
+	assert(cpu_pc(a) == 8);
+	assert(cpu_register(a, 1) == 2);
+	assert(cpu_run_until(a, 0x100, CPU_NO_LIMIT) == CPU_HALTED);
+	assert(cpu_pc(a) == 12);
+	assert(cpu_register(a, 1) == 3);
+	assert(!cpu_step(a));
+	printf("cpu_run_until: OK\n");
+
+	// code written through the api is picked up by the next run
+	cpu_write32(a, 8, MOVZ_X1(9));
+	cpu_set_pc(a, 0);
+	cpu_run(a);
+	assert(cpu_register(a, 1) == 9);
+	printf("cpu_write32 into code: OK\n");
+
+	// a budget stops mid-block after exactly that many instructions, and counts add up
+	cpu_reset(a);
+	mem_store32(0, ADD_X1_1);
+	mem_store32(4, ADD_X1_1);
+	mem_store32(8, B_BACK_2);
+	assert(cpu_run_until(a, CPU_NO_STOP_PC, 100) == CPU_BUDGET_EXHAUSTED);
+	assert(cpu_instructions(a) == 100);
+	assert(cpu_register(a, 1) == 67);
+	assert(cpu_pc(a) == 4);
+	assert(cpu_run_until(a, CPU_NO_STOP_PC, 2) == CPU_BUDGET_EXHAUSTED);
+	assert(cpu_instructions(a) == 102);
+	assert(cpu_register(a, 1) == 68);
+	printf("instruction budget: OK\n");
+
+	// a profile counts every executed instruction by class and pc, stepped or run in blocks
+	cpu_reset(a);
+	a->profile = profile_create();
+	mem_store32(0, ADD_X1_1);
+	mem_store32(4, ADD_X1_1);
+	mem_store32(8, B_BACK_2);
+	assert(cpu_run_until(a, CPU_NO_STOP_PC, 100) == CPU_BUDGET_EXHAUSTED);
+	assert(a->profile->class_count[CLASS_DP_IMM_ARITH] == 67);
+	assert(a->profile->class_count[CLASS_BRANCH] == 33);
+	assert(a->profile->pc_count[0] == 34);
+	assert(a->profile->pc_count[1] == 33);
+	assert(a->profile->pc_count[2] == 33);
+	profile_destroy(a->profile);
+	a->profile = NULL;
+	printf("profile: OK\n");
+
+	// a snapshot taken mid-run restores registers, flags, memory and the count into another machine
+	cpu_write32(a, 0x1000, 0xBEEF);
+	setZ(false);
+	setC(true);
+	assert(cpu_save(a, "cpu_test.snap"));
+	assert(cpu_restore(b, "cpu_test.snap"));
+	remove("cpu_test.snap");
+	assert(cpu_register(b, 1) == cpu_register(a, 1));
+	assert(cpu_pc(b) == cpu_pc(a));
+	assert(cpu_instructions(b) == cpu_instructions(a));
+	assert(cpu_read32(b, 0x1000) == 0xBEEF);
+	assert(mem_page_dirty(1) && !mem_page_dirty(2));
+	assert(!getZ() && getC());
+	assert(cpu_run_until(b, CPU_NO_STOP_PC, 3) == CPU_BUDGET_EXHAUSTED);
+	assert(cpu_register(b, 1) == cpu_register(a, 1) + 2);
+	assert(!cpu_restore(b, "cpu_test.snap"));
+	printf("snapshot: OK\n");
+
+	// a machine matches its own exported state, and every changed word is counted
+	FILE *ref = fopen("cpu_test.state", "w");
+	assert(ref);
+	cpu_export(b, ref);
+	fclose(ref);
+	FILE *report = tmpfile();
+	assert(report);
+	assert(cpu_diff(b, "cpu_test.state", report) == 0);
+	cpu_write32(b, 0x1000, 0xBEEE);
+	cpu_write32(b, 0x20000, 1);
+	cpu_set_register(b, 3, 3);
+	assert(cpu_diff(b, "cpu_test.state", report) == 3);
+	assert(cpu_diff(b, "cpu_test.missing", report) == -1);
+	fclose(report);
+	remove("cpu_test.state");
+	printf("cpu_diff: OK\n");
+
+	cpu_destroy(a);
+	cpu_destroy(b);
+	return EXIT_SUCCESS;
+}
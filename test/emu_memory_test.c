@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "emu_memory.h"
+
+#define MMIO_BASE 0x3F200000
+
+// a device with one register per 8 bytes, logging the last access it saw
+typedef struct {
+	uint64_t regs[4];
+	uint32_t offset;
+	size_t size;
+} FakeDevice;
+
+static uint64_t fake_load(void *device, uint32_t offset, size_t size) {
+	FakeDevice *d = device;
+	d->offset = offset;
+	d->size = size;
+	return d->regs[offset / 8];
+}
+
+static void fake_store(void *device, uint32_t offset, uint64_t value, size_t size) {
+	FakeDevice *d = device;
+	d->offset = offset;
+	d->size = size;
+	d->regs[offset / 8] = value;
+}
+
+int main(void) {
+	mem_init();
+
+	// nothing is written after init
+	for (uint32_t page = 0; page < MEM_NUM_PAGES; ++page) {
+		assert(!mem_page_dirty(page));
+	}
+	assert(mem_load64(0x1000) == 0);
+
+	// a store straddling two pages marks both
+	mem_store64(0x1ffc, 0x1122334455667788);
+	assert(mem_page_dirty(1));
+	assert(mem_page_dirty(2));
+	assert(!mem_page_dirty(0));
+	assert(!mem_page_dirty(3));
+	assert(mem_load32(0x1ffc) == 0x55667788);
+	assert(mem_load32(0x2000) == 0x11223344);
+	assert(mem_load16(0x1ffe) == 0x5566);
+	assert(mem_load8(0x2003) == 0x11);
+	printf("dirty pages: OK\n");
+
+	// export only lists the non-zero words, in address order
+	mem_store32(MEMORY_SIZE - 4, 0xCAFEBABE);
+	char buffer[256] = {0};
+	FILE *out = tmpfile();
+	export_memory(out);
+	rewind(out);
+	fread(buffer, 1, sizeof(buffer) - 1, out);
+	fclose(out);
+	assert(strcmp(buffer, "Non-Zero Memory:\n"
+						  "0x00001ffc: 55667788\n"
+						  "0x00002000: 11223344\n"
+						  "0x001ffffc: cafebabe\n") == 0);
+	printf("export_memory: OK\n");
+
+	// accesses above memory go to the device mapped there, with offsets into its region
+	FakeDevice device = {.regs = {0, 0x1122334455667788}};
+	assert(!mem_map_mmio(0x1000, 32, fake_load, fake_store, &device));
+	assert(mem_map_mmio(MMIO_BASE, 32, fake_load, fake_store, &device));
+	assert(mem_load64(MMIO_BASE + 8) == 0x1122334455667788);
+	assert(device.offset == 8 && device.size == 8);
+	mem_store32(MMIO_BASE + 16, 0xCAFEBABE);
+	assert(device.regs[2] == 0xCAFEBABE && device.offset == 16 && device.size == 4);
+	mem_store8(MMIO_BASE + 24, 0xFF);
+	assert(mem_load8(MMIO_BASE + 24) == 0xFF && device.size == 1);
+	assert(!mem_page_dirty(0));
+	printf("mmio: OK\n");
+
+	// reinitialising starts from clean memory again
+	mem_destroy();
+	mem_init();
+	assert(!mem_page_dirty(1));
+	assert(mem_load64(0x1ffc) == 0);
+	printf("mem_init after mem_destroy: OK\n");
+
+	mem_destroy();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+#include "bit_utils.h"
+#include "emu_registers.h"
+#include "fde.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define W32 0
+#define X64 1
+
+// adds and subs (immediate), opc 1 and 3
+#define BUILD_ARITH_IMM(sf, opc, imm12, rn, rd) \
+	(((unsigned)(sf) << 31) | ((opc) << 29) | (4u << 26) | (2u << 23) | ((imm12) << 10) | \
+	 ((rn) << 5) | (rd))
+#define ADDS 1
+#define SUBS 3
+
+int main(void) {
+	registers_init();
+
+	// signed overflow on adds: X64
+	register_store(1, 0x7FFFFFFFFFFFFFFF, X64);
+	decode_and_execute(BUILD_ARITH_IMM(X64, ADDS, 1, 1, 0));
+	assert(getN());
+	assert(!getZ());
+	assert(!getC());
+	assert(getV());
+	printf("X64 adds overflow: OK\n");
+
+	// carry out of bit 31 on adds: W32
+	register_store(1, 0xFFFFFFFF, W32);
+	decode_and_execute(BUILD_ARITH_IMM(W32, ADDS, 1, 1, 0));
+	assert(register_load(0, W32) == 0);
+	assert(!getN());
+	assert(getZ());
+	assert(getC());
+	assert(!getV());
+	printf("W32 adds carry: OK\n");
+
+	// borrow and signed overflow on subs: W32
+	register_store(1, 0x80000000, W32);
+	decode_and_execute(BUILD_ARITH_IMM(W32, SUBS, 1, 1, 0));
+	assert(!getN());
+	assert(!getZ());
+	assert(getC());
+	assert(getV());
+	register_store(1, 0, W32);
+	decode_and_execute(BUILD_ARITH_IMM(W32, SUBS, 1, 1, 0));
+	assert(getN());
+	assert(!getC());
+	assert(!getV());
+	printf("W32 subs borrow/overflow: OK\n");
+
+	// setting a single flag keeps the others from the last flag-setting instruction
+	register_store(1, 5, X64);
+	decode_and_execute(BUILD_ARITH_IMM(X64, SUBS, 5, 1, 0));
+	setV(true);
+	assert(getZ());
+	assert(getC());
+	assert(!getN());
+	assert(getV());
+	printf("set after lazy flags: OK\n");
+
+	// conditions read the recorded result: 3 - 5 is LT but not EQ
+	register_store(1, 3, X64);
+	decode_and_execute(BUILD_ARITH_IMM(X64, SUBS, 5, 1, 0));
+	assert(check_condition(0xB));
+	assert(!check_condition(0x0));
+	assert(!check_condition(0xC));
+	printf("conditions after subs: OK\n");
+
+	registers_destroy();
+	return EXIT_SUCCESS;
+}
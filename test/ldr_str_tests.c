@@ -3,11 +3,29 @@
 #include "bit_utils.h"
 #include "emu_registers.h"
 #include "emu_memory.h"
+#include "fde.h"
 #include <assert.h>
 
 #define W32 0
 #define X64 1
 
+#define STR 0
+#define LDR 1
+#define POST 0
+#define PRE 1
+
+#define BUILD_UOFFSET(sf, l, imm12, xn, rt) \
+	((1u << 31) | ((unsigned)(sf) << 30) | (0x39u << 24) | ((l) << 22) | ((imm12) << 10) | \
+	 ((xn) << 5) | (rt))
+#define BUILD_INDEXED(sf, l, simm9, i, xn, rt) \
+	((1u << 31) | ((unsigned)(sf) << 30) | (0x38u << 24) | ((l) << 22) | ((simm9) << 12) | \
+	 ((i) << 11) | (1u << 10) | ((xn) << 5) | (rt))
+#define BUILD_REGOFFSET(sf, l, xm, xn, rt) \
+	((1u << 31) | ((unsigned)(sf) << 30) | (0x38u << 24) | ((l) << 22) | (1u << 21) | \
+	 ((xm) << 16) | (0x1Au << 10) | ((xn) << 5) | (rt))
+#define BUILD_LITERAL(sf, simm19, rt) \
+	(((unsigned)(sf) << 30) | (0x18u << 24) | ((simm19) << 5) | (rt))
+
 int main(void) {
 	registers_init();
 	mem_init();
@@ -17,13 +35,14 @@ int main(void) {
 	/* ldr_uoffset: X64 */
 	register_store(1, 200, X64);
 	mem_store64(264, 0x1122334455667788);
-	assert(ldr_uoffset(0, 1, 8, X64) == 0x1122334455667788);
+	decode_and_execute(BUILD_UOFFSET(X64, LDR, 8, 1, 0));
+	assert(register_load(0, X64) == 0x1122334455667788);
 	printf("X64: ldr_uoffset passed\n");
 
 	/* str_uoffset: X64 */
 	register_store(1, 400, X64);
 	register_store(0, 0xAABBCCDDEEFF0011, X64);
-	str_uoffset(0, 1, 5, X64);
+	decode_and_execute(BUILD_UOFFSET(X64, STR, 5, 1, 0));
 	assert(mem_load64(440) == 0xAABBCCDDEEFF0011);
 	printf("X64: str_uoffset passed\n");
 	
@@ -31,14 +50,15 @@ int main(void) {
 	/* ldr_preindexed: X64 */
 	register_store(1, 600, X64);
 	mem_store64(608, 0xDEADBEEFCAFEBABE);
-	assert(ldr_preindexed(0, 1, 8, X64) == 0xDEADBEEFCAFEBABE);
+	decode_and_execute(BUILD_INDEXED(X64, LDR, 8, PRE, 1, 0));
+	assert(register_load(0, X64) == 0xDEADBEEFCAFEBABE);
 	assert(register_load(1, X64) == 608);
 	printf("X64: ldr_preindexed passed\n");
 	
 	/* str_preindexed: X64 */
 	register_store(1, 800, X64);
 	register_store(0, 0x123456789ABCDEF0, X64);
-	str_preindexed(0, 1, 16, X64); 
+	decode_and_execute(BUILD_INDEXED(X64, STR, 16, PRE, 1, 0)); 
 	assert(mem_load64(816) == 0x123456789ABCDEF0);
 	assert(register_load(1, X64) == 816);
 	printf("X64: str_preindexed passed\n");
@@ -46,14 +66,15 @@ int main(void) {
 	/* ldr_postindexed: X64 */
 	register_store(1, 1000, X64);
 	mem_store64(1000, 0xBEEFDEADCAFEBABE);
-	assert(ldr_postindexed(0, 1, 12, X64) == 0xBEEFDEADCAFEBABE);
+	decode_and_execute(BUILD_INDEXED(X64, LDR, 12, POST, 1, 0));
+	assert(register_load(0, X64) == 0xBEEFDEADCAFEBABE);
 	assert(register_load(1, X64) == 1012);
 	printf("X64: ldr_postindexed passed\n");
 
 	/* str_postindexed: X64 */
 	register_store(1, 1200, X64);
 	register_store(0, 0xCAFEBABECAFEBABE, X64);
-	str_postindexed(0, 1, 24, X64);
+	decode_and_execute(BUILD_INDEXED(X64, STR, 24, POST, 1, 0));
 	assert(mem_load64(1200) == 0xCAFEBABECAFEBABE);
 	assert(register_load(1, X64) == 1224);
 	printf("X64: str_postindexed passed\n");
@@ -62,47 +83,51 @@ int main(void) {
 	register_store(1, 1400, X64);
 	register_store(2, 20, X64);
 	mem_store64(1420, 0xDEAD1111BEEF2222);
-	assert(ldr_regoffset(0, 1, 2, X64) == 0xDEAD1111BEEF2222);
+	decode_and_execute(BUILD_REGOFFSET(X64, LDR, 2, 1, 0));
+	assert(register_load(0, X64) == 0xDEAD1111BEEF2222);
 	printf("X64: ldr_regoffset passed\n");
 
 	/* str_regoffset: X64 */
 	register_store(1, 1600, X64);
 	register_store(2, 32, X64);
 	register_store(0, 0x4444555566667777, X64);
-	str_regoffset(0, 1, 2, X64);
+	decode_and_execute(BUILD_REGOFFSET(X64, STR, 2, 1, 0));
 	assert(mem_load64(1632) == 0x4444555566667777);
 	printf("X64: str_regoffset passed\n");
 
 	/* ldr_literal: X64 */
 	uint64_t pc_x = pc_load();
 	mem_store64(pc_x + 12, 0xAABBCCDDEEFF0011);  
-	assert(ldr_literal(0, 3, X64) == 0xAABBCCDDEEFF0011);
+	decode_and_execute(BUILD_LITERAL(X64, 3, 0));
+	assert(register_load(0, X64) == 0xAABBCCDDEEFF0011);
 	printf("X64: ldr_literal passed\n");	
 
 	/* ldr_uoffset: W32 */
 	register_store(1, 100, X64);
 	mem_store32(116, 0xCAFEBABE);
-	assert(ldr_uoffset(0, 1, 4, W32) == 0xCAFEBABE);
+	decode_and_execute(BUILD_UOFFSET(W32, LDR, 4, 1, 0));
+	assert(register_load(0, W32) == 0xCAFEBABE);
 	printf("W32: ldr_uoffset passed\n");
 
 	/* str_uoffset: W32 */
 	register_store(1, 300, X64);
 	register_store(0, 0x12345678, W32);
-	str_uoffset(0, 1, 2, W32); 
+	decode_and_execute(BUILD_UOFFSET(W32, STR, 2, 1, 0)); 
 	assert(mem_load32(308) == 0x12345678);
 	printf("W32: str_uoffset passed\n");
 
 	/* ldr_preindexed: W32 */
 	register_store(1, 500, X64);
 	mem_store32(508, 0xABCD1234);  
-	assert(ldr_preindexed(0, 1, 8, W32) == 0xABCD1234);
+	decode_and_execute(BUILD_INDEXED(W32, LDR, 8, PRE, 1, 0));
+	assert(register_load(0, W32) == 0xABCD1234);
 	assert(register_load(1, X64) == 508);  
 	printf("W32: ldr_preindexed passed\n");
 	
 	/* str_preindexed: W32 */
 	register_store(1, 700, X64);
 	register_store(0, 0x55667788, W32);
-	str_preindexed(0, 1, 12, W32); 
+	decode_and_execute(BUILD_INDEXED(W32, STR, 12, PRE, 1, 0)); 
 	assert(mem_load32(712) == 0x55667788);
 	assert(register_load(1, X64) == 712);
 	printf("W32: str_preindexed passed\n");
@@ -110,7 +135,8 @@ int main(void) {
 	/* ldr_postindexed: W32 */
 	register_store(1, 900, X64);
 	mem_store32(900, 0xDEADBEEF);
-	assert(ldr_postindexed(0, 1, 4, W32) == 0xDEADBEEF);
+	decode_and_execute(BUILD_INDEXED(W32, LDR, 4, POST, 1, 0));
+	assert(register_load(0, W32) == 0xDEADBEEF);
 	assert(register_load(1, X64) == 904);
 	printf("W32: ldr_postindexed passed\n");
 
@@ -118,7 +144,7 @@ int main(void) {
 	/* str_postindexed: W32 */
 	register_store(1, 1100, X64);
 	register_store(0, 0xFACEFACE, W32);
-	str_postindexed(0, 1, 16, W32);
+	decode_and_execute(BUILD_INDEXED(W32, STR, 16, POST, 1, 0));
 	assert(mem_load32(1100) == 0xFACEFACE);
 	assert(register_load(1, X64) == 1116);
 	printf("W32: str_postindexed passed\n");
@@ -127,21 +153,23 @@ int main(void) {
 	register_store(1, 1300, X64); 
 	register_store(2, 12, X64);  
 	mem_store32(1312, 0x11112222);
-	assert(ldr_regoffset(0, 1, 2, W32) == 0x11112222);
+	decode_and_execute(BUILD_REGOFFSET(W32, LDR, 2, 1, 0));
+	assert(register_load(0, W32) == 0x11112222);
 	printf("W32: ldr_regoffset passed\n");
 
 	/* str_regoffset: W32 */
 	register_store(1, 1500, X64);
 	register_store(2, 16, X64);
 	register_store(0, 0x77778888, W32);
-	str_regoffset(0, 1, 2, W32);
+	decode_and_execute(BUILD_REGOFFSET(W32, STR, 2, 1, 0));
 	assert(mem_load32(1516) == 0x77778888);
 	printf("W32: str_regoffset passed\n");
 
 	/* ldr_literal: W32 */
 	uint64_t pc_w = pc_load();
 	mem_store32(pc_w + 4, 0xFEEDBEEF);
-	assert(ldr_literal(0, 1, W32) == 0xFEEDBEEF);
+	decode_and_execute(BUILD_LITERAL(W32, 1, 0));
+	assert(register_load(0, W32) == 0xFEEDBEEF);
 	printf("W32: ldr_literal passed\n");
 
 	registers_destroy();
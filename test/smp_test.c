@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "smp.h"
+
+#define BIN_FILE "smp_test.bin"
+
+// both cores start at 0 with their index in x0. core 0 stores 42 and then a flag, core 1 spins
+// on the flag and then loads the 42
+static const uint32_t program[] = {
+	0xd2804002, // movz x2, #0x200
+	0xf1000005, // subs x5, x0, #0
+	0x540000c1, // b.ne core1
+	0xd2800541, // movz x1, #42
+	0xf9000441, // str x1, [x2, #8]
+	0xd2800023, // movz x3, #1
+	0xf9000043, // str x3, [x2]
+	0x8a000000, // halt
+	0xf9400043, // core1: ldr x3, [x2]
+	0xf1000065, // subs x5, x3, #0
+	0x54ffffc0, // b.eq core1
+	0xf9400444, // ldr x4, [x2, #8]
+	0x8a000000, // halt
+};
+
+int main(void) {
+	FILE *bin = fopen(BIN_FILE, "wb");
+	assert(bin);
+	fwrite(program, sizeof(program), 1, bin);
+	fclose(bin);
+
+	// cores see each other's stores, a flag handed over after the data carries the data with it.
+	// compiled blocks access memory the same way, once core 1's spin loop gets hot
+	for (int use_jit = 0; use_jit <= 1; ++use_jit) {
+		Smp *smp = smp_create(2, use_jit);
+		assert(smp_load(smp, BIN_FILE, NULL));
+		assert(smp_run(smp, CPU_NO_LIMIT));
+		assert(cpu_register(smp->cores[0], 0) == 0 && cpu_register(smp->cores[1], 0) == 1);
+		assert(cpu_register(smp->cores[1], 4) == 42);
+		assert(cpu_pc(smp->cores[0]) == 0x1c && cpu_pc(smp->cores[1]) == 0x30);
+		assert(cpu_read32(smp->cores[1], 0x208) == 42);
+		smp_destroy(smp);
+	}
+	printf("shared memory: OK\n");
+
+	Smp *smp = smp_create(2, false);
+
+	// cores can start anywhere. with core 0 starting at its halt nobody sets the flag, so core 1
+	// spins until its budget is used up
+	uint64_t entries[] = {0x1c, 0};
+	assert(smp_load(smp, BIN_FILE, entries));
+	assert(!smp_run(smp, 1000));
+	assert(cpu_instructions(smp->cores[0]) == 0 && cpu_instructions(smp->cores[1]) == 1000);
+	assert(smp_instructions(smp) == 1000);
+	printf("entry points and budget: OK\n");
+
+	// every core's registers go in front of the memory they share
+	FILE *out = tmpfile();
+	assert(out);
+	smp_export(smp, out);
+	rewind(out);
+	char line[64];
+	int cores = 0;
+	int memory = 0;
+	while (fgets(line, sizeof(line), out)) {
+		cores += strncmp(line, "Core ", 5) == 0;
+		memory += strncmp(line, "Non-Zero Memory", 15) == 0;
+	}
+	fclose(out);
+	assert(cores == 2 && memory == 1);
+	printf("smp_export: OK\n");
+
+	smp_destroy(smp);
+	remove(BIN_FILE);
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "emu_memory.h"
+#include "trace.h"
+
+#define TRACE_FILE "trace_test.trc"
+#define MOVZ_X1_5 0xD28000A1u
+#define MOVZ_X2_0x100 0xD2802002u
+#define STR_X1_X2 0xF9000041u
+#define SUBS_X1_X1_5 0xF1001421u
+#define HALT 0x8a000000u
+#define MOVZ_X2_MMIO 0xD2A7E402u // movz x2, #0x3f20, lsl #16
+#define MOVZ_X1_0x20 0xD2800401u
+#define STR_W1_X2_0x1C 0xB9001C41u
+
+#define MMIO_BASE 0x3F200000
+
+static uint64_t last_store;
+
+// a write-only register, tracing must not read it back
+static uint64_t device_load(void *device, uint32_t offset, size_t size) {
+	assert(false);
+	return 0;
+}
+
+static void device_store(void *device, uint32_t offset, uint64_t value, size_t size) {
+	last_store = value;
+}
+
+int main(void) {
+	CpuState *cpu = cpu_create(false);
+	cpu_write32(cpu, 0, MOVZ_X1_5);
+	cpu_write32(cpu, 4, MOVZ_X2_0x100);
+	cpu_write32(cpu, 8, STR_X1_X2);
+	cpu_write32(cpu, 12, SUBS_X1_X1_5);
+	cpu_write32(cpu, 16, HALT);
+	cpu->trace = trace_open(TRACE_FILE);
+	assert(cpu->trace);
+	cpu_run(cpu);
+	assert(trace_close(cpu->trace));
+	cpu->trace = NULL;
+	assert(cpu_register(cpu, 1) == 0);
+	assert(cpu_read32(cpu, 0x100) == 5);
+
+	// every executed instruction reads back with what it changed, the halt is not executed
+	FILE *in = fopen(TRACE_FILE, "rb");
+	assert(in);
+	TraceCodec codec;
+	TraceRecord r;
+	assert(trace_read_header(in, &codec));
+	assert(trace_read(in, &codec, &r));
+	assert(r.pc == 0 && r.raw == MOVZ_X1_5);
+	assert(r.num_regs == 1 && r.regs[0] == 1 && r.reg_values[0] == 5);
+	assert(r.store_bytes == 0);
+	assert(trace_read(in, &codec, &r));
+	assert(r.pc == 4 && r.num_regs == 1 && r.regs[0] == 2 && r.reg_values[0] == 0x100);
+	assert(trace_read(in, &codec, &r));
+	assert(r.pc == 8 && r.num_regs == 0);
+	assert(r.store_bytes == 8 && r.store_addr == 0x100 && r.store_value == 5);
+	assert(trace_read(in, &codec, &r));
+	assert(r.pc == 12 && r.num_regs == 1 && r.reg_values[0] == 0);
+	assert(r.nzcv == 0x6); // Z and C
+	assert(!trace_read(in, &codec, &r));
+	fclose(in);
+	remove(TRACE_FILE);
+	printf("trace round trip: OK\n");
+
+	// stores to a device are traced with the value written
+	cpu_reset(cpu);
+	cpu_bind(cpu);
+	assert(mem_map_mmio(MMIO_BASE, 0x40, device_load, device_store, NULL));
+	cpu_write32(cpu, 0, MOVZ_X2_MMIO);
+	cpu_write32(cpu, 4, MOVZ_X1_0x20);
+	cpu_write32(cpu, 8, STR_W1_X2_0x1C);
+	cpu_write32(cpu, 12, HALT);
+	cpu->trace = trace_open(TRACE_FILE);
+	assert(cpu->trace);
+	cpu_run(cpu);
+	assert(trace_close(cpu->trace));
+	cpu->trace = NULL;
+	assert(last_store == 0x20);
+	in = fopen(TRACE_FILE, "rb");
+	assert(in);
+	assert(trace_read_header(in, &codec));
+	for (int i = 0; i < 3; ++i) {
+		assert(trace_read(in, &codec, &r));
+	}
+	assert(r.store_bytes == 4 && r.store_addr == MMIO_BASE + 0x1C && r.store_value == 0x20);
+	fclose(in);
+	remove(TRACE_FILE);
+	printf("trace of an mmio store: OK\n");
+
+	cpu_destroy(cpu);
+	return EXIT_SUCCESS;
+}